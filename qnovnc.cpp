@@ -4,6 +4,10 @@
 #include "qnovncscreen.h"
 #include "qnovncclient.h"
 #include "qnovncframecache.h"
+#include "qnovncsimd.h"
+#ifdef QNOVNC_HAVE_H264
+#include "qnovnch264encoder.h"
+#endif
 #include <QtWebSockets/QWebSocketServer>
 #include <QtWebSockets/QWebSocket>
 #include <qendian.h>
@@ -12,6 +16,9 @@
 #include <QtGui/qguiapplication.h>
 #include <QtGui/QWindow>
 #include <QtGui/QPainter>
+#include <QtGui/QImageWriter>
+#include <QtCore/QBuffer>
+#include <QtCore/QHash>
 
 #ifdef Q_OS_WIN
 #include <winsock2.h>
@@ -20,8 +27,17 @@
 #endif
 
 #include <QtCore/QDebug>
+#include <QtCore/qalgorithms.h>
+#include <algorithm>
 #include <utility>
 #include <limits>
+#include <cmath>
+
+#ifdef QNOVNC_HAVE_JPEG
+#include <cstdio>
+#include <csetjmp>
+#include <jpeglib.h>
+#endif
 
 #ifdef max
 #undef max
@@ -35,110 +51,267 @@ QNoVncDirtyMap::QNoVncDirtyMap(QNoVncScreen *screen)
     : screen(screen), bytesPerPixel(0), numDirty(0)
 {
     bytesPerPixel = (screen->depth() + 7) / 8;
-    bufferWidth = screen->geometry().width();
-    bufferHeight = screen->geometry().height();
-    bufferStride = bufferWidth * bytesPerPixel;
-    buffer = new uchar[bufferHeight * bufferStride];
+    resize(screen->geometry().size());
+}
+
+QNoVncDirtyMap::~QNoVncDirtyMap()
+{
+}
 
+void QNoVncDirtyMap::resize(const QSize &size)
+{
+    bufferWidth = size.width();
+    bufferHeight = size.height();
     mapWidth = (bufferWidth + MAP_TILE_SIZE - 1) / MAP_TILE_SIZE;
     mapHeight = (bufferHeight + MAP_TILE_SIZE - 1) / MAP_TILE_SIZE;
     numTiles = mapWidth * mapHeight;
-    map = new uchar[numTiles];
+    wordsPerRow = (mapWidth + 63) / 64;
+    map.fill(0, wordsPerRow * mapHeight);
+    rowSummary.fill(0, (mapHeight + 63) / 64);
+    changedTiles.fill(0, wordsPerRow * mapHeight);
+    numDirty = 0;
 }
 
-QNoVncDirtyMap::~QNoVncDirtyMap()
+int QNoVncDirtyMap::findBit(const quint64 *words, int from, int count, bool set)
 {
-    delete[] map;
-    delete[] buffer;
+    int index = from / 64;
+    const int wordCount = (count + 63) / 64;
+    if (index >= wordCount)
+        return count;
+    quint64 word = (set ? words[index] : ~words[index]) & (~Q_UINT64_C(0) << (from % 64));
+    while (!word) {
+        if (++index == wordCount)
+            return count;
+        word = set ? words[index] : ~words[index];
+    }
+    return qMin(count, index * 64 + int(qCountTrailingZeroBits(word)));
+}
+
+bool QNoVncDirtyMap::RunIterator::next(Run *run)
+{
+    const int width = m_map->mapWidth;
+    for (;;) {
+        if (m_row < 0 || m_x >= width) {
+            m_row = findBit(m_map->rowSummary.constData(), m_row + 1, m_map->mapHeight, true);
+            m_x = 0;
+            if (m_row >= m_map->mapHeight) {
+                m_x = width;
+                return false;
+            }
+        }
+        const quint64 *words = m_map->map.constData() + m_row * m_map->wordsPerRow;
+        const int start = findBit(words, m_x, width, true);
+        if (start >= width) {
+            m_x = width;
+            continue;
+        }
+        m_x = findBit(words, start, width, false);
+        *run = { start, m_row, m_x - start };
+        return true;
+    }
 }
 
 void QNoVncDirtyMap::reset()
 {
-    memset(map, 1, numTiles);
-    memset(buffer, 0, bufferHeight * bufferStride);
+    // Padding bits past the last column stay clear
+    for (int y = 0; y < mapHeight; ++y) {
+        quint64 *words = map.data() + y * wordsPerRow;
+        std::fill(words, words + wordsPerRow, ~Q_UINT64_C(0));
+        if (mapWidth % 64)
+            words[wordsPerRow - 1] = (Q_UINT64_C(1) << (mapWidth % 64)) - 1;
+    }
+    for (int i = 0; i < rowSummary.size(); ++i) {
+        const int rows = qMin(64, mapHeight - i * 64);
+        rowSummary[i] = rows == 64 ? ~Q_UINT64_C(0) : (Q_UINT64_C(1) << rows) - 1;
+    }
     numDirty = numTiles;
 }
 
+void QNoVncDirtyMap::clear()
+{
+    if (numDirty == 0)
+        return;
+    for (int y = findBit(rowSummary.constData(), 0, mapHeight, true); y < mapHeight;
+         y = findBit(rowSummary.constData(), y + 1, mapHeight, true)) {
+        quint64 *words = map.data() + y * wordsPerRow;
+        std::fill(words, words + wordsPerRow, Q_UINT64_C(0));
+    }
+    rowSummary.fill(0);
+    numDirty = 0;
+}
+
 inline bool QNoVncDirtyMap::dirty(int x, int y) const
 {
-    return map[y * mapWidth + x];
+    return map[y * wordsPerRow + x / 64] & (Q_UINT64_C(1) << (x % 64));
+}
+
+inline void QNoVncDirtyMap::setDirty(int x, int y)
+{
+    quint64 &word = map[y * wordsPerRow + x / 64];
+    const quint64 bit = Q_UINT64_C(1) << (x % 64);
+    if (word & bit)
+        return;
+    word |= bit;
+    rowSummary[y / 64] |= Q_UINT64_C(1) << (y % 64);
+    ++numDirty;
 }
 
-inline void QNoVncDirtyMap::setClean(int x, int y)
+void QNoVncDirtyMap::setClean(int x, int y)
 {
-    map[y * mapWidth + x] = 0;
+    quint64 *words = map.data() + y * wordsPerRow;
+    const quint64 bit = Q_UINT64_C(1) << (x % 64);
+    if (!(words[x / 64] & bit))
+        return;
+    words[x / 64] &= ~bit;
     --numDirty;
+    if (std::all_of(words, words + wordsPerRow, [](quint64 word) { return word == 0; }))
+        rowSummary[y / 64] &= ~(Q_UINT64_C(1) << (y % 64));
 }
 
-template <class T>
-void QNoVncDirtyMapOptimized<T>::setDirty(int tileX, int tileY, bool force)
+bool QNoVncDirtyMap::hasPreviousFrame() const
 {
+    const QImage *image = screen->image();
+    return shadow.size() == image->size() && shadow.format() == image->format();
+}
+
+QRegion QNoVncDirtyMap::compare(const QRegion &touched, const QRegion &trusted)
+{
+    const QImage *image = screen->image();
+    const QRect bounds = image->rect();
+    const bool fresh = !hasPreviousFrame();
+    if (fresh) {
+        shadow = image->copy();
+        resize(image->size());
+    }
+
     static bool alwaysForce = qEnvironmentVariableIsSet("QT_VNC_NO_COMPAREBUFFER");
-    if (alwaysForce)
-        force = true;
-
-    bool changed = false;
-
-    if (!force) {
-        const int lstep = bufferStride;
-        const int startX = tileX * MAP_TILE_SIZE;
-        const int startY = tileY * MAP_TILE_SIZE;
-        const uchar *scrn = screen->image()->constBits()
-                            + startY * lstep + startX * bytesPerPixel;
-        uchar *old = buffer + startY * bufferStride + startX * sizeof(T);
-
-        const int tileHeight = (startY + MAP_TILE_SIZE > bufferHeight ?
-                                bufferHeight - startY : MAP_TILE_SIZE);
-        const int tileWidth = (startX + MAP_TILE_SIZE > bufferWidth ?
-                               bufferWidth - startX : MAP_TILE_SIZE);
-        const bool doInlines = (tileWidth == MAP_TILE_SIZE);
-
-        int y = tileHeight;
-
-        if (doInlines) { // hw: memcmp/memcpy is inlined when using constants
-            while (y) {
-                if (memcmp(old, scrn, sizeof(T) * MAP_TILE_SIZE)) {
-                    changed = true;
-                    break;
-                }
-                scrn += lstep;
-                old += bufferStride;
-                --y;
-            }
 
-            while (y) {
-                memcpy(old, scrn, sizeof(T) * MAP_TILE_SIZE);
-                scrn += lstep;
-                old += bufferStride;
-                --y;
-            }
-        } else {
-            while (y) {
-                if (memcmp(old, scrn, sizeof(T) * tileWidth)) {
-                    changed = true;
-                    break;
-                }
-                scrn += lstep;
-                old += bufferStride;
-                --y;
+    changedTiles.fill(0);
+    for (const QRect &rect : trusted & bounds) {
+        for (int y = rect.top() / MAP_TILE_SIZE; y <= rect.bottom() / MAP_TILE_SIZE; ++y) {
+            quint64 *words = changedTiles.data() + y * wordsPerRow;
+            for (int x = rect.left() / MAP_TILE_SIZE; x <= rect.right() / MAP_TILE_SIZE; ++x)
+                words[x / 64] |= Q_UINT64_C(1) << (x % 64);
+        }
+    }
+    for (const QRect &rect : touched & bounds) {
+        const int x0 = rect.left() / MAP_TILE_SIZE;
+        const int x1 = rect.right() / MAP_TILE_SIZE;
+        for (int y = rect.top() / MAP_TILE_SIZE; y <= rect.bottom() / MAP_TILE_SIZE; ++y) {
+            quint64 *words = changedTiles.data() + y * wordsPerRow;
+            for (int x = x0; x <= x1; ++x) {
+                const quint64 bit = Q_UINT64_C(1) << (x % 64);
+                if (!(words[x / 64] & bit) && (fresh || alwaysForce || tileChanged(x, y)))
+                    words[x / 64] |= bit;
             }
+        }
+    }
 
-            while (y) {
-                memcpy(old, scrn, sizeof(T) * tileWidth);
-                scrn += lstep;
-                old += bufferStride;
-                --y;
-            }
+    // Merge into the map a word at a time
+    for (int y = 0; y < mapHeight; ++y) {
+        const quint64 *changed = changedTiles.constData() + y * wordsPerRow;
+        quint64 *words = map.data() + y * wordsPerRow;
+        bool rowChanged = false;
+        for (int i = 0; i < wordsPerRow; ++i) {
+            if (!changed[i])
+                continue;
+            numDirty += qPopulationCount(changed[i] & ~words[i]);
+            words[i] |= changed[i];
+            rowChanged = true;
+        }
+        if (rowChanged)
+            rowSummary[y / 64] |= Q_UINT64_C(1) << (y % 64);
+    }
+
+    return tileRegion(changedTiles);
+}
+
+QRegion QNoVncDirtyMap::tileRegion(const QVector<quint64> &bits) const
+{
+    QVector<QRect> rects;
+    QVarLengthArray<QPair<int, int>, 32> band; // runs of the open band
+    QVarLengthArray<QPair<int, int>, 32> runs;
+    int bandTop = 0;
+
+    auto closeBand = [&](int bottom) {
+        const int top = bandTop * MAP_TILE_SIZE;
+        const int height = qMin(bottom * MAP_TILE_SIZE, bufferHeight) - top;
+        for (const auto &run : std::as_const(band)) {
+            const int left = run.first * MAP_TILE_SIZE;
+            rects.append(QRect(left, top, qMin(run.second * MAP_TILE_SIZE, bufferWidth) - left, height));
+        }
+    };
+
+    for (int y = 0; y < mapHeight; ++y) {
+        const quint64 *words = bits.constData() + y * wordsPerRow;
+        runs.clear();
+        for (int x = findBit(words, 0, mapWidth, true); x < mapWidth;
+             x = findBit(words, x, mapWidth, true)) {
+            const int end = findBit(words, x, mapWidth, false);
+            runs.append(qMakePair(x, end));
+            x = end;
         }
+        if (runs.size() == band.size() && std::equal(runs.cbegin(), runs.cend(), band.cbegin()))
+            continue;
+        closeBand(y);
+        band = runs;
+        bandTop = y;
     }
+    closeBand(mapHeight);
 
-    const int mapIndex = tileY * mapWidth + tileX;
-    if ((force || changed) && !map[mapIndex]) {
-        map[mapIndex] = 1;
-        ++numDirty;
+    QRegion region;
+    if (!rects.isEmpty())
+        region.setRects(rects.constData(), int(rects.size()));
+    return region;
+}
+
+void QNoVncDirtyMap::commit()
+{
+    if (numDirty == 0)
+        return;
+
+    const QImage *image = screen->image();
+    const qsizetype stride = image->bytesPerLine();
+    const uchar *src = image->constBits();
+    uchar *dst = shadow.bits();
+    RunIterator it(this);
+    Run run;
+    while (it.next(&run)) {
+        const int top = run.y * MAP_TILE_SIZE;
+        const int height = qMin(MAP_TILE_SIZE, bufferHeight - top);
+        const int left = run.x * MAP_TILE_SIZE;
+        const qsizetype offset = top * stride + qsizetype(left) * bytesPerPixel;
+        const qsizetype length = qsizetype(qMin((run.x + run.length) * MAP_TILE_SIZE, bufferWidth) - left)
+                                 * bytesPerPixel;
+        for (int row = 0; row < height; ++row)
+            memcpy(dst + offset + row * stride, src + offset + row * stride, length);
     }
 }
 
+void QNoVncDirtyMap::setFormat(QImage::Format format)
+{
+    if (!shadow.isNull() && shadow.format() != format)
+        shadow = shadow.convertToFormat(format);
+}
+
+template <class T>
+bool QNoVncDirtyMapOptimized<T>::tileChanged(int tileX, int tileY) const
+{
+    const QImage *image = screen->image();
+    const qsizetype lstep = image->bytesPerLine();
+    const int startX = tileX * MAP_TILE_SIZE;
+    const int startY = tileY * MAP_TILE_SIZE;
+    const uchar *scrn = image->constBits() + startY * lstep + startX * sizeof(T);
+    const uchar *old = shadow.constBits() + startY * lstep + startX * sizeof(T);
+
+    const int tileHeight = (startY + MAP_TILE_SIZE > bufferHeight ?
+                            bufferHeight - startY : MAP_TILE_SIZE);
+    const int tileWidth = (startX + MAP_TILE_SIZE > bufferWidth ?
+                           bufferWidth - startX : MAP_TILE_SIZE);
+
+    return QNoVncSimd::anyRowChanged(old, scrn, lstep, sizeof(T) * tileWidth, tileHeight);
+}
+
 template class QNoVncDirtyMapOptimized<unsigned char>;
 template class QNoVncDirtyMapOptimized<unsigned short>;
 template class QNoVncDirtyMapOptimized<unsigned int>;
@@ -286,6 +459,12 @@ void QRfbPixelFormat::write(QIODevice *s)
     s->write(buf, 16);
 }
 
+quint32 QRfbPixelFormat::colorMask() const
+{
+    return (((1u << redBits) - 1) << redShift)
+           | (((1u << greenBits) - 1) << greenShift)
+           | (((1u << blueBits) - 1) << blueShift);
+}
 
 void QRfbServerInit::setName(const char *n)
 {
@@ -425,119 +604,297 @@ bool QRfbClientCutText::read(QIODevice *s)
     return true;
 }
 
-void QRfbRawEncoder::write()
+QImage QRfbEncoder::updateImage(QRegion *rgn) const
 {
-    QIODevice *socket = client->clientSocket();
-
-    const int bytesPerPixel = client->clientBytesPerPixel();
-    QRegion rgn = client->dirtyRegion();
-    qCDebug(lcVnc) << "QRfbRawEncoder::write()" << rgn;
-
     QImage screenImage = client->server()->screenImage();
 
-    if (qEnvironmentVariableIntValue("QNOVNC_VISUALIZE_UPDATE") == 1 && !rgn.isEmpty()) {
+    if (qEnvironmentVariableIntValue("QNOVNC_VISUALIZE_UPDATE") == 1 && !rgn->isEmpty()) {
         QPainter p(&screenImage);
         p.setCompositionMode(QPainter::CompositionMode_SourceOver);
-        p.fillRect(rgn.boundingRect(), QColor(0, 0, 255, 64));
+        p.fillRect(rgn->boundingRect(), QColor(0, 0, 255, 64));
         p.end();
     }
 
-    rgn &= screenImage.rect();
+    *rgn &= screenImage.rect();
+    return screenImage;
+}
 
-    const auto rectsInRegion = rgn.rectCount();
+const uchar *QRfbEncoder::clientPixels(const QImage &screenImage, const QRect &rect,
+                                       QByteArray *buffer, qsizetype *stride) const
+{
+    const qsizetype rowBytes = qsizetype(rect.width()) * client->clientBytesPerPixel();
+
+    // The cache holds the screen itself, not a copy painted over for
+    // QNOVNC_VISUALIZE_UPDATE
+    const bool converted = client->doPixelConversion();
+    if (converted && screenImage.constBits() == client->server()->screen()->image()->constBits()) {
+        return client->server()->frameCache()->convertedPixels(
+            screenImage, rect, client->pixelConverter(), buffer, stride);
+    }
 
-    {
-        const char tmp[2] = { 0, 0 }; // msg type, padding
-        socket->write(tmp, sizeof(tmp));
+    const qsizetype linestep = screenImage.bytesPerLine();
+    const uchar *screendata = screenImage.constScanLine(rect.y())
+                              + rect.x() * screenImage.depth() / 8;
+    if (stride && !converted) {
+        *stride = linestep;
+        return screendata;
     }
 
-    {
-        const quint16 count = htons(rectsInRegion);
-        socket->write(reinterpret_cast<const char *>(&count), sizeof(count));
+    const qsizetype rawSize = rowBytes * rect.height();
+    if (buffer->size() < rawSize)
+        buffer->resize(rawSize);
+    uchar *dst = reinterpret_cast<uchar *>(buffer->data());
+    for (int i = 0; i < rect.height(); ++i) {
+        if (converted)
+            client->convertPixels(reinterpret_cast<char *>(dst),
+                                  reinterpret_cast<const char *>(screendata), rect.width());
+        else
+            memcpy(dst, screendata, rowBytes);
+        screendata += linestep;
+        dst += rowBytes;
     }
+    if (stride)
+        *stride = rowBytes;
+    return reinterpret_cast<const uchar *>(buffer->constData());
+}
 
-    if (rectsInRegion <= 0)
-        return;
+void QRfbEncoder::write()
+{
+    QIODevice *socket = client->clientSocket();
+    QRegion rgn = client->dirtyRegion();
+    qCDebug(lcVnc) << "QRfbEncoder::write()" << rgn;
 
-    for (const QRect &tileRect: rgn) {
-        const QRfbRect rect(tileRect.x(), tileRect.y(),
-                            tileRect.width(), tileRect.height());
-        rect.write(socket);
+    const QImage screenImage = updateImage(&rgn);
 
-        const quint32 encoding = htonl(0); // raw encoding
-        socket->write(reinterpret_cast<const char *>(&encoding), sizeof(encoding));
+    findDuplicateTiles(screenImage, &rgn);
 
-        if (client->doPixelConversion()) {
-            QByteArray pixels = client->server()->frameCache()->getConvertedPixels(
-                screenImage, tileRect, client->pixelFormat());
-            socket->write(pixels.constData(), pixels.size());
-        } else {
-            qsizetype linestep = screenImage.bytesPerLine();
-            const uchar *screendata = screenImage.scanLine(rect.y)
-                                      + rect.x * screenImage.depth() / 8;
-            for (int i = 0; i < rect.h; ++i) {
-                socket->write(reinterpret_cast<const char*>(screendata), rect.w * bytesPerPixel);
-                screendata += linestep;
+    m_rects.clear();
+    for (const QRect &rect : rgn)
+        splitRect(rect, &m_rects);
+    writeUpdateHeader(socket, m_rects.size());
+
+    beginUpdate();
+    for (const QRect &rect : std::as_const(m_rects))
+        writeRect(socket, screenImage, rect);
+    writeTileCopies(socket);
+}
+
+void QRfbEncoder::findDuplicateTiles(const QImage &screenImage, QRegion *rgn)
+{
+    m_tileCopies.clear();
+    if (!client->supportsCopyRect())
+        return;
+
+    const int bytesPerPixel = screenImage.depth() / 8;
+    const qsizetype rowBytes = qsizetype(MAP_TILE_SIZE) * bytesPerPixel;
+    QHash<size_t, QPoint> tiles;
+    QRegion duplicates;
+
+    // The region's rects come top to bottom, so every source is sent
+    // before the copies made from it
+    for (const QRect &rect : std::as_const(*rgn)) {
+        const int left = (rect.left() + MAP_TILE_SIZE - 1) / MAP_TILE_SIZE * MAP_TILE_SIZE;
+        const int top = (rect.top() + MAP_TILE_SIZE - 1) / MAP_TILE_SIZE * MAP_TILE_SIZE;
+        for (int y = top; y + MAP_TILE_SIZE - 1 <= rect.bottom(); y += MAP_TILE_SIZE) {
+            for (int x = left; x + MAP_TILE_SIZE - 1 <= rect.right(); x += MAP_TILE_SIZE) {
+                const uchar *first = screenImage.constScanLine(y) + x * bytesPerPixel;
+
+                // Solid tiles are cheaper as part of a larger fill
+                bool solid = memcmp(first, first + bytesPerPixel, rowBytes - bytesPerPixel) == 0;
+                size_t hash = qHashBits(first, rowBytes);
+                for (int row = 1; row < MAP_TILE_SIZE; ++row) {
+                    const uchar *line = screenImage.constScanLine(y + row) + x * bytesPerPixel;
+                    solid = solid && memcmp(line, first, rowBytes) == 0;
+                    hash = qHashBits(line, rowBytes, hash);
+                }
+                if (solid)
+                    continue;
+
+                const QPoint tile(x, y);
+                const auto it = tiles.constFind(hash);
+                if (it == tiles.constEnd()) {
+                    tiles.insert(hash, tile);
+                    continue;
+                }
+                const QPoint source = *it;
+                bool equal = true;
+                for (int row = 0; row < MAP_TILE_SIZE && equal; ++row) {
+                    equal = memcmp(screenImage.constScanLine(y + row) + x * bytesPerPixel,
+                                   screenImage.constScanLine(source.y() + row) + source.x() * bytesPerPixel,
+                                   rowBytes) == 0;
+                }
+                if (!equal)
+                    continue;
+
+                // Neighbouring copies of neighbouring tiles become one
+                const QRect copy(tile, QSize(MAP_TILE_SIZE, MAP_TILE_SIZE));
+                duplicates += copy;
+                if (!m_tileCopies.isEmpty()) {
+                    TileCopy &last = m_tileCopies.last();
+                    if (last.rect.top() == y && last.rect.right() + 1 == x
+                        && last.source.y() == source.y()
+                        && last.source.x() + last.rect.width() == source.x()) {
+                        last.rect.setRight(copy.right());
+                        continue;
+                    }
+                }
+                m_tileCopies.append({ copy, source });
             }
         }
     }
+    *rgn -= duplicates;
 }
 
-QRfbZlibEncoder::QRfbZlibEncoder(QNoVncClient *s)
-    : QRfbEncoder(s)
+void QRfbEncoder::writeTileCopies(QIODevice *socket)
 {
-    memset(&m_stream, 0, sizeof(m_stream));
+    for (const TileCopy &copy : std::as_const(m_tileCopies)) {
+        writeRectHeader(socket, copy.rect, 1); // CopyRect encoding
+        const quint16 src[2] = { htons(static_cast<quint16>(copy.source.x())),
+                                 htons(static_cast<quint16>(copy.source.y())) };
+        socket->write(reinterpret_cast<const char *>(src), sizeof(src));
+
+        // A copy of a JPEG rect is just as lossy
+        if (client->isLossy(QRect(copy.source, copy.rect.size())))
+            client->markLossy(copy.rect);
+    }
+    m_tileCopies.clear();
 }
 
-QRfbZlibEncoder::~QRfbZlibEncoder()
+void QRfbEncoder::writeUpdateHeader(QIODevice *socket, int rectCount) const
 {
-    if (m_streamInitialized)
-        deflateEnd(&m_stream);
+    const QVector<QRect> copies = client->copyRects();
+    const quint16 tmp[2] = { htons(0), // msg type, padding
+                             htons(static_cast<quint16>(rectCount + copies.size()
+                                                        + m_tileCopies.size())) };
+    socket->write(reinterpret_cast<const char *>(tmp), sizeof(tmp));
+
+    // CopyRects go first, they copy from what the client showed before
+    const QPoint delta = client->copyDelta();
+    for (const QRect &rect : copies) {
+        writeRectHeader(socket, rect, 1); // CopyRect encoding
+        const quint16 src[2] = { htons(static_cast<quint16>(rect.x() - delta.x())),
+                                 htons(static_cast<quint16>(rect.y() - delta.y())) };
+        socket->write(reinterpret_cast<const char *>(src), sizeof(src));
+
+        // Scrolled or moved JPEG pixels stay lossy where they land
+        if (client->isLossy(rect.translated(-delta)))
+            client->markLossy(rect);
+    }
+}
+
+void QRfbEncoder::writeRectHeader(QIODevice *socket, const QRect &rect, qint32 encoding)
+{
+    const QRfbRect r(rect.x(), rect.y(), rect.width(), rect.height());
+    r.write(socket);
+
+    const qint32 enc = qToBigEndian(encoding);
+    socket->write(reinterpret_cast<const char *>(&enc), sizeof(enc));
+}
+
+void QRfbEncoder::writeRawRect(QIODevice *socket, const QRect &rect,
+                               const uchar *pixels, qsizetype stride) const
+{
+    writeRectHeader(socket, rect, 0); // raw encoding
+
+    const qsizetype rowBytes = qsizetype(rect.width()) * client->clientBytesPerPixel();
+    if (stride == rowBytes) {
+        socket->write(reinterpret_cast<const char *>(pixels), rowBytes * rect.height());
+        return;
+    }
+    for (int i = 0; i < rect.height(); ++i) {
+        socket->write(reinterpret_cast<const char *>(pixels), rowBytes);
+        pixels += stride;
+    }
+}
+
+quint32 QRfbEncoder::clientPixelMask() const
+{
+    const QRfbPixelFormat &format = client->pixelFormat();
+    if (format.bitsPerPixel != 32 || !format.trueColor)
+        return 0xffffffff;
+
+    uchar maskBytes[4];
+    if (format.bigEndian)
+        qToBigEndian(format.colorMask(), maskBytes);
+    else
+        qToLittleEndian(format.colorMask(), maskBytes);
+    quint32 mask;
+    memcpy(&mask, maskBytes, sizeof(mask));
+    return mask;
+}
+
+void QRfbPalette::clear(int maxColors)
+{
+    for (int i = 0; i < m_size; ++i)
+        m_slotIndex[m_slots[i]] = -1;
+    m_size = 0;
+    m_maxColors = qMin(maxColors, int(MaxColors));
+    m_overflow = false;
+}
+
+void QRfbRawEncoder::writeRect(QIODevice *socket, const QImage &screenImage, const QRect &rect)
+{
+    qsizetype stride = 0;
+    const uchar *pixels = clientPixels(screenImage, rect, &buffer, &stride);
+    writeRawRect(socket, rect, pixels, stride);
 }
 
-void QRfbZlibEncoder::ensurePixelBuffer(qsizetype size)
+QRfbZlibStream::QRfbZlibStream()
 {
-    if (m_pixelBuffer.size() < size)
-        m_pixelBuffer.resize(size);
+    memset(&m_stream, 0, sizeof(m_stream));
 }
 
-void QRfbZlibEncoder::ensureCompressedBuffer(qsizetype minimumSize)
+QRfbZlibStream::~QRfbZlibStream()
 {
-    if (m_compressBuffer.size() < minimumSize)
-        m_compressBuffer.resize(minimumSize);
+    if (m_streamInitialized)
+        deflateEnd(&m_stream);
 }
 
-bool QRfbZlibEncoder::compressCurrentBuffer(qsizetype rawSize, qsizetype *compressedSize)
+bool QRfbZlibStream::compress(const char *data, qsizetype size, qsizetype *compressedSize)
 {
     if (!m_streamInitialized) {
         m_stream.zalloc = Z_NULL;
         m_stream.zfree = Z_NULL;
         m_stream.opaque = Z_NULL;
-        if (deflateInit(&m_stream, 2) != Z_OK) {
+        if (deflateInit(&m_stream, m_level) != Z_OK) {
             qWarning(lcVnc) << "Failed to initialize zlib stream";
             return false;
         }
         m_streamInitialized = true;
+        m_streamLevel = m_level;
     }
 
-    if (rawSize <= 0 || rawSize > std::numeric_limits<uLong>::max()) {
-        qWarning(lcVnc) << "Rectangle too large for zlib compression" << rawSize;
+    if (size <= 0 || size > std::numeric_limits<uLong>::max()) {
+        qWarning(lcVnc) << "Rectangle too large for zlib compression" << size;
         return false;
     }
 
-    uLong bound = deflateBound(&m_stream, static_cast<uLong>(rawSize));
-    bound += 6; // extra headroom for Z_SYNC_FLUSH trailer
+    uLong bound = deflateBound(&m_stream, static_cast<uLong>(size));
+    bound += 12; // extra headroom for Z_SYNC_FLUSH trailer and level changes
     if (bound > std::numeric_limits<uInt>::max()) {
         qWarning(lcVnc) << "zlib bound exceeds supported size" << bound;
         return false;
     }
-    ensureCompressedBuffer(static_cast<qsizetype>(bound));
+    if (m_compressBuffer.size() < static_cast<qsizetype>(bound))
+        m_compressBuffer.resize(static_cast<qsizetype>(bound));
 
-    m_stream.next_in = reinterpret_cast<Bytef *>(m_pixelBuffer.data());
-    m_stream.avail_in = static_cast<uInt>(rawSize);
     m_stream.next_out = reinterpret_cast<Bytef *>(m_compressBuffer.data());
     m_stream.avail_out = static_cast<uInt>(m_compressBuffer.size());
 
+    if (m_level != m_streamLevel) {
+        // Everything was flushed by the previous call, so this cannot lose
+        // input; whatever deflateParams emits stays in front of the new data.
+        m_stream.next_in = Z_NULL;
+        m_stream.avail_in = 0;
+        if (deflateParams(&m_stream, m_level, Z_DEFAULT_STRATEGY) == Z_OK)
+            m_streamLevel = m_level;
+        else
+            qWarning(lcVnc) << "Failed to change zlib compression level to" << m_level;
+    }
+
+    m_stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    m_stream.avail_in = static_cast<uInt>(size);
+
     while (m_stream.avail_in > 0) {
         const int ret = deflate(&m_stream, Z_SYNC_FLUSH);
         if (ret != Z_OK) {
@@ -554,179 +911,1490 @@ bool QRfbZlibEncoder::compressCurrentBuffer(qsizetype rawSize, qsizetype *compre
     return true;
 }
 
-void QRfbZlibEncoder::write()
+void QRfbZlibEncoder::beginUpdate()
 {
-    QIODevice *socket = client->clientSocket();
+    m_stream.setLevel(client->compressionLevel());
+}
+
+void QRfbZlibEncoder::writeRect(QIODevice *socket, const QImage &screenImage, const QRect &rect)
+{
+    const qsizetype rowBytes = qsizetype(rect.width()) * client->clientBytesPerPixel();
+    const qsizetype rawSize = rowBytes * rect.height();
+
+    // We MUST use a per-client stream for compression because deflate is stateful
+    const uchar *pixels = clientPixels(screenImage, rect, &m_pixelBuffer);
+
+    qsizetype compressedSize = 0;
+    if (m_stream.compress(reinterpret_cast<const char *>(pixels), rawSize, &compressedSize)) {
+        writeRectHeader(socket, rect, 6); // zlib encoding
+        const quint32 length = htonl(static_cast<quint32>(compressedSize));
+        socket->write(reinterpret_cast<const char *>(&length), sizeof(length));
+        socket->write(m_stream.compressedData(), compressedSize);
+    } else {
+        writeRawRect(socket, rect, pixels, rowBytes);
+    }
+}
+
+// Calls func(color, length) for every run of identical (masked) pixels,
+// scanning the block row by row; runs continue across row boundaries.
+template <class T, class Func>
+static inline void forEachPixelRun(const uchar *pixels, qsizetype stride,
+                                   int width, int height, T mask, Func func)
+{
+    T runColor = 0;
+    int runLength = 0;
+    for (int y = 0; y < height; ++y) {
+        const T *row = reinterpret_cast<const T *>(pixels + y * stride);
+        for (int x = 0; x < width; ++x) {
+            const T p = row[x] & mask;
+            if (runLength && p == runColor) {
+                ++runLength;
+                continue;
+            }
+            if (runLength)
+                func(runColor, runLength);
+            runColor = p;
+            runLength = 1;
+        }
+    }
+    if (runLength)
+        func(runColor, runLength);
+}
+
+static inline int zrleRunLengthBytes(int length)
+{
+    return (length - 1) / 255 + 1;
+}
+
+static inline uchar *zrleWriteRunLength(uchar *out, int length)
+{
+    length -= 1;
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = uchar(length);
+    return out;
+}
+
+bool QRfbZrleEncoder::setupCPixel()
+{
+    const QRfbPixelFormat &format = client->pixelFormat();
     const int bytesPerPixel = client->clientBytesPerPixel();
-    QRegion rgn = client->dirtyRegion();
-    qCDebug(lcVnc) << "QRfbZlibEncoder::write()" << rgn;
 
-    QImage screenImage = client->server()->screenImage();
+    m_cpixelSize = bytesPerPixel;
+    m_cpixelOffset = 0;
+    m_pixelMask = clientPixelMask();
 
-    if (qEnvironmentVariableIntValue("QNOVNC_VISUALIZE_UPDATE") == 1 && !rgn.isEmpty()) {
-        QPainter p(&screenImage);
-        p.setCompositionMode(QPainter::CompositionMode_SourceOver);
-        p.fillRect(rgn.boundingRect(), QColor(0, 0, 255, 64));
-        p.end();
+    if (bytesPerPixel == 1 || bytesPerPixel == 2)
+        return true;
+    if (bytesPerPixel != 4)
+        return false;
+    if (!format.trueColor)
+        return true;
+
+    // CPIXEL drops the unused byte of 32bpp pixels with depth <= 24
+    const quint32 colorMask = format.colorMask();
+    const bool fitsLow = !(colorMask & 0xff000000);
+    const bool fitsHigh = !(colorMask & 0x000000ff);
+    if (format.depth <= 24 && (fitsLow || fitsHigh)) {
+        m_cpixelSize = 3;
+        m_cpixelOffset = (fitsLow != format.bigEndian) ? 0 : 1;
     }
+    return true;
+}
 
-    rgn &= screenImage.rect();
+template <class T>
+inline uchar *QRfbZrleEncoder::writeCPixel(uchar *out, T pixel) const
+{
+    memcpy(out, reinterpret_cast<const uchar *>(&pixel) + m_cpixelOffset, m_cpixelSize);
+    return out + m_cpixelSize;
+}
+
+template <class T>
+uchar *QRfbZrleEncoder::encodeRect(uchar *out, const uchar *pixels, qsizetype stride,
+                                   int width, int height)
+{
+    for (int ty = 0; ty < height; ty += TileSize) {
+        const int th = qMin(int(TileSize), height - ty);
+        for (int tx = 0; tx < width; tx += TileSize) {
+            const int tw = qMin(int(TileSize), width - tx);
+            out = encodeTile<T>(out, pixels + ty * stride + tx * qsizetype(sizeof(T)),
+                                stride, tw, th);
+        }
+    }
+    return out;
+}
 
-    const int rectsInRegion = rgn.rectCount();
+template <class T>
+uchar *QRfbZrleEncoder::encodeTile(uchar *out, const uchar *pixels, qsizetype stride,
+                                   int width, int height)
+{
+    enum SubEncoding {
+        Raw = 0,
+        Solid = 1,
+        PlainRle = 128
+    };
+
+    const T mask = T(m_pixelMask);
+
+    // Gather the colour count and the run statistics all subencodings need
+    m_palette.clear(127);
+    qsizetype plainRleBytes = 0;
+    qsizetype paletteRleBytes = 0;
+    forEachPixelRun<T>(pixels, stride, width, height, mask, [&](T color, int length) {
+        m_palette.insert(color);
+        plainRleBytes += m_cpixelSize + zrleRunLengthBytes(length);
+        paletteRleBytes += (length == 1) ? 1 : 1 + zrleRunLengthBytes(length);
+    });
 
-    {
-        const char tmp[2] = { 0, 0 };
-        socket->write(tmp, sizeof(tmp));
+    const int paletteSize = m_palette.overflowed() ? 0 : m_palette.size();
+    if (paletteSize == 1) {
+        *out++ = Solid;
+        return writeCPixel<T>(out, T(m_palette.color(0)));
     }
 
-    {
-        const quint16 count = htons(static_cast<quint16>(rectsInRegion));
-        socket->write(reinterpret_cast<const char *>(&count), sizeof(count));
+    enum { UseRaw, UsePlainRle, UsePaletteRle, UsePacked } mode = UseRaw;
+    qsizetype best = qsizetype(width) * height * m_cpixelSize;
+    if (plainRleBytes < best) {
+        best = plainRleBytes;
+        mode = UsePlainRle;
     }
 
-    if (rectsInRegion <= 0)
-        return;
+    int bitsPerIndex = 0;
+    if (paletteSize) {
+        const qsizetype paletteBytes = qsizetype(paletteSize) * m_cpixelSize;
+        if (paletteBytes + paletteRleBytes < best) {
+            best = paletteBytes + paletteRleBytes;
+            mode = UsePaletteRle;
+        }
+        if (paletteSize <= 16) {
+            bitsPerIndex = paletteSize == 2 ? 1 : paletteSize <= 4 ? 2 : 4;
+            const qsizetype packedBytes = paletteBytes
+                    + qsizetype(height) * ((width * bitsPerIndex + 7) / 8);
+            if (packedBytes <= best)
+                mode = UsePacked;
+        }
+    }
 
-    const bool needConversion = client->doPixelConversion();
-    const int screenDepth = screenImage.depth();
-
-    for (const QRect &tileRect : rgn) {
-        const QRfbRect rect(tileRect.x(), tileRect.y(),
-                            tileRect.width(), tileRect.height());
-        rect.write(socket);
-
-        const qsizetype rowBytes = qsizetype(rect.w) * bytesPerPixel;
-        const qsizetype rawSize = rowBytes * rect.h;
-        
-        QByteArray rawData;
-        if (needConversion) {
-            rawData = client->server()->frameCache()->getConvertedPixels(
-                screenImage, tileRect, client->pixelFormat());
-        } else {
-            ensurePixelBuffer(rawSize);
-            char *dst = m_pixelBuffer.data();
-            const qsizetype linestep = screenImage.bytesPerLine();
-            const uchar *screendata = screenImage.scanLine(rect.y)
-                                      + rect.x * screenImage.depth() / 8;
-            for (int i = 0; i < rect.h; ++i) {
-                memcpy(dst, screendata, rowBytes);
-                screendata += linestep;
-                dst += rowBytes;
+    switch (mode) {
+    case UseRaw:
+        *out++ = Raw;
+        for (int y = 0; y < height; ++y) {
+            const T *row = reinterpret_cast<const T *>(pixels + y * stride);
+            for (int x = 0; x < width; ++x)
+                out = writeCPixel<T>(out, T(row[x] & mask));
+        }
+        break;
+
+    case UsePlainRle:
+        *out++ = PlainRle;
+        forEachPixelRun<T>(pixels, stride, width, height, mask, [&](T color, int length) {
+            out = writeCPixel<T>(out, color);
+            out = zrleWriteRunLength(out, length);
+        });
+        break;
+
+    case UsePaletteRle:
+        *out++ = uchar(PlainRle + paletteSize);
+        for (int i = 0; i < paletteSize; ++i)
+            out = writeCPixel<T>(out, T(m_palette.color(i)));
+        forEachPixelRun<T>(pixels, stride, width, height, mask, [&](T color, int length) {
+            const uchar index = uchar(m_palette.indexOf(color));
+            if (length == 1) {
+                *out++ = index;
+            } else {
+                *out++ = index | 128;
+                out = zrleWriteRunLength(out, length);
             }
-            rawData = m_pixelBuffer.left(rawSize); // Copy for deflate
-        }
-
-        // We MUST use a per-client buffer for compression because deflate is stateful
-        m_pixelBuffer = rawData; 
-        
-        qsizetype compressedSize = 0;
-        bool useZlib = compressCurrentBuffer(rawSize, &compressedSize);
-        if (useZlib) {
-            const quint32 encoding = htonl(6);
-            socket->write(reinterpret_cast<const char *>(&encoding), sizeof(encoding));
-            const quint32 length = htonl(static_cast<quint32>(compressedSize));
-            socket->write(reinterpret_cast<const char *>(&length), sizeof(length));
-            socket->write(m_compressBuffer.constData(), compressedSize);
-        } else {
-            const quint32 encoding = htonl(0);
-            socket->write(reinterpret_cast<const char *>(&encoding), sizeof(encoding));
-            socket->write(m_pixelBuffer.constData(), rawSize);
+        });
+        break;
+
+    case UsePacked: {
+        *out++ = uchar(paletteSize);
+        for (int i = 0; i < paletteSize; ++i)
+            out = writeCPixel<T>(out, T(m_palette.color(i)));
+        T lastColor = T(m_palette.color(0));
+        uint lastIndex = 0;
+        for (int y = 0; y < height; ++y) {
+            const T *row = reinterpret_cast<const T *>(pixels + y * stride);
+            uint byte = 0;
+            int used = 0;
+            for (int x = 0; x < width; ++x) {
+                const T p = row[x] & mask;
+                if (p != lastColor) {
+                    lastColor = p;
+                    lastIndex = uint(m_palette.indexOf(p));
+                }
+                byte = (byte << bitsPerIndex) | lastIndex;
+                used += bitsPerIndex;
+                if (used == 8) {
+                    *out++ = uchar(byte);
+                    byte = 0;
+                    used = 0;
+                }
+            }
+            if (used)
+                *out++ = uchar(byte << (8 - used));
         }
+        break;
+    }
     }
-}
 
-#if QT_CONFIG(cursor)
-QNoVncClientCursor::QNoVncClientCursor()
-{
-    QWindow *w = QGuiApplication::focusWindow();
-    QCursor c = w ? w->cursor() : QCursor(Qt::ArrowCursor);
-    changeCursor(&c, nullptr);
+    return out;
 }
 
-QNoVncClientCursor::~QNoVncClientCursor()
+void QRfbZrleEncoder::beginUpdate()
 {
+    m_cpixelValid = setupCPixel();
+    m_stream.setLevel(client->compressionLevel());
 }
 
-void QNoVncClientCursor::write(QNoVncClient *client) const
+void QRfbZrleEncoder::writeRect(QIODevice *socket, const QImage &screenImage, const QRect &rect)
 {
-    QIODevice *socket = client->clientSocket();
+    qsizetype stride = 0;
+    const uchar *pixels = clientPixels(screenImage, rect, &m_pixelBuffer, &stride);
 
-    // FramebufferUpdate header
-    {
-        const quint16 tmp[6] = { htons(0),
-                                 htons(1),
-                                 htons(static_cast<uint16_t>(hotspot.x())), htons(static_cast<uint16_t>(hotspot.y())),
-                                 htons(static_cast<uint16_t>(cursor.width())),
-                                 htons(static_cast<uint16_t>(cursor.height())) };
-        socket->write(reinterpret_cast<const char*>(tmp), sizeof(tmp));
+    if (!m_cpixelValid) {
+        writeRawRect(socket, rect, pixels, stride);
+        return;
+    }
 
-        const qint32 encoding = qToBigEndian(-239);
-        socket->write(reinterpret_cast<const char*>(&encoding), sizeof(encoding));
+    const int width = rect.width();
+    const int height = rect.height();
+    const qsizetype tiles = qsizetype((width + TileSize - 1) / TileSize)
+                            * ((height + TileSize - 1) / TileSize);
+    const qsizetype bound = qsizetype(width) * height * m_cpixelSize + tiles;
+    if (m_tileBuffer.size() < bound)
+        m_tileBuffer.resize(bound);
+
+    uchar *begin = reinterpret_cast<uchar *>(m_tileBuffer.data());
+    uchar *end = begin;
+    switch (client->clientBytesPerPixel()) {
+    case 1:
+        end = encodeRect<quint8>(begin, pixels, stride, width, height);
+        break;
+    case 2:
+        end = encodeRect<quint16>(begin, pixels, stride, width, height);
+        break;
+    default:
+        end = encodeRect<quint32>(begin, pixels, stride, width, height);
+        break;
     }
 
-    if (cursor.isNull())
+    qsizetype compressedSize = 0;
+    if (!m_stream.compress(m_tileBuffer.constData(), end - begin, &compressedSize)) {
+        writeRawRect(socket, rect, pixels, stride);
         return;
-
-    // write pixels
-    Q_ASSERT(cursor.hasAlphaChannel());
-    const QImage img = cursor.convertToFormat(client->server()->screen()->format());
-    const int n = client->clientBytesPerPixel() * img.width();
-    const int depth = img.depth();
-    char *buffer = new char[n];
-    for (int i = 0; i < img.height(); ++i) {
-        client->convertPixels(buffer, (const char*)img.scanLine(i), img.width(), depth);
-        socket->write(buffer, n);
     }
-    delete[] buffer;
 
-    // write mask
-    const QImage bitmap = cursor.createAlphaMask().convertToFormat(QImage::Format_Mono);
-    Q_ASSERT(bitmap.depth() == 1);
-    Q_ASSERT(bitmap.size() == img.size());
-    const int width = (bitmap.width() + 7) / 8;
-    for (int i = 0; i < bitmap.height(); ++i)
-        socket->write(reinterpret_cast<const char*>(bitmap.scanLine(i)), width);
+    writeRectHeader(socket, rect, 16); // ZRLE encoding
+    const quint32 length = htonl(static_cast<quint32>(compressedSize));
+    socket->write(reinterpret_cast<const char *>(&length), sizeof(length));
+    socket->write(m_stream.compressedData(), compressedSize);
 }
 
-void QNoVncClientCursor::changeCursor(QCursor *widgetCursor, QWindow *window)
+void QRfbTightEncoder::splitRect(const QRect &rect, QVector<QRect> *rects) const
 {
-    Q_UNUSED(window);
-    const Qt::CursorShape shape = widgetCursor ? widgetCursor->shape() : Qt::ArrowCursor;
-
-    if (shape == Qt::BitmapCursor) {
-        // application supplied cursor
-        hotspot = widgetCursor->hotSpot();
-        cursor = widgetCursor->pixmap().toImage();
-    } else {
-        // system cursor
-        QPlatformCursorImage platformImage(nullptr, nullptr, 0, 0, 0, 0);
-        platformImage.set(shape);
-        cursor = *platformImage.image();
-        hotspot = platformImage.hotspot();
+    for (int x = rect.x(); x <= rect.right(); x += MaxRectWidth) {
+        const int width = qMin(int(MaxRectWidth), rect.right() - x + 1);
+        const int bandHeight = qMax(1, MaxRectPixels / width);
+        for (int y = rect.y(); y <= rect.bottom(); y += bandHeight) {
+            const int height = qMin(bandHeight, rect.bottom() - y + 1);
+            rects->append(QRect(x, y, width, height));
+        }
     }
-    for (auto client : std::as_const(clients))
-        client->setDirtyCursor();
 }
 
-void QNoVncClientCursor::addClient(QNoVncClient *client)
+void QRfbTightEncoder::setupTPixel()
 {
-    if (!clients.contains(client)) {
-        clients.append(client);
-        // Force a cursor update when the client connects.
-        client->setDirtyCursor();
+    const QRfbPixelFormat &format = client->pixelFormat();
+
+    m_pixelMask = clientPixelMask();
+    m_tpixelSize = client->clientBytesPerPixel();
+    m_tpixel24 = format.bitsPerPixel == 32 && format.depth == 24 && format.trueColor
+                 && format.redBits == 8 && format.greenBits == 8 && format.blueBits == 8;
+    if (m_tpixel24)
+        m_tpixelSize = 3;
+    m_swapPixel = format.bigEndian != (Q_BYTE_ORDER == Q_BIG_ENDIAN);
+
+    // JPEG needs true colour on the client side and is only used when the
+    // client asked for it with a quality level pseudo-encoding, and never
+    // while lossy rects are being refined.
+    m_jpegQuality = -1;
+#ifdef QNOVNC_HAVE_JPEG
+    static const int jpegQualities[10] = { 15, 29, 41, 42, 62, 77, 79, 86, 92, 100 };
+    const int qualityLevel = client->qualityLevel();
+    if (qualityLevel >= 0 && !client->isRefining() && format.trueColor && format.bitsPerPixel >= 16
+        && format.redBits <= 8 && format.greenBits <= 8 && format.blueBits <= 8) {
+        m_jpegQuality = jpegQualities[qBound(0, qualityLevel, 9)];
     }
+#endif
+
+    const int compressionLevel = client->compressionLevel();
+    for (QRfbZlibStream &stream : m_streams)
+        stream.setLevel(compressionLevel);
 }
 
-uint QNoVncClientCursor::removeClient(QNoVncClient *client)
+template <class T>
+inline void QRfbTightEncoder::colorComponents(T pixel, int *rgb) const
 {
-    clients.removeOne(client);
-    return clients.size();
+    const QRfbPixelFormat &format = client->pixelFormat();
+    const quint32 p = m_swapPixel ? quint32(qbswap(pixel)) : quint32(pixel);
+    rgb[0] = int((p >> format.redShift) & ((1u << format.redBits) - 1)) << (8 - format.redBits);
+    rgb[1] = int((p >> format.greenShift) & ((1u << format.greenBits) - 1)) << (8 - format.greenBits);
+    rgb[2] = int((p >> format.blueShift) & ((1u << format.blueBits) - 1)) << (8 - format.blueBits);
 }
-#endif // QT_CONFIG(cursor)
 
-QNoVncServer::QNoVncServer(QNoVncScreen *screen, quint16 port, QString host)
-    : QNoVnc_screen(screen)
-    , m_port(port)
+template <class T>
+bool QRfbTightEncoder::isSmooth(const uchar *pixels, qsizetype stride, int width, int height) const
+{
+    // Same idea as the classic TightVNC detector: sample short rows along
+    // diagonals and look at the neighbour differences. Photos have few flat
+    // runs and a smoothly falling histogram of small steps, while UI content
+    // is mostly flat with a few hard edges that JPEG would smear.
+    enum { SubrowWidth = 7, MaxAverageError = 2000 };
+
+    if (width < 8 || height < 8)
+        return false;
+
+    quint32 stats[256] = {};
+    quint32 samples = 0;
+    int x = 0;
+    int y = 0;
+    while (y < height && x < width) {
+        for (int d = 0; d < height - y && d < width - x - SubrowWidth; ++d) {
+            const T *row = reinterpret_cast<const T *>(pixels + (y + d) * stride) + x + d;
+            int left[3];
+            colorComponents<T>(row[0], left);
+            for (int dx = 1; dx <= SubrowWidth; ++dx) {
+                int rgb[3];
+                colorComponents<T>(row[dx], rgb);
+                for (int c = 0; c < 3; ++c) {
+                    ++stats[qAbs(rgb[c] - left[c])];
+                    left[c] = rgb[c];
+                }
+            }
+            samples += SubrowWidth;
+        }
+        if (width > height) {
+            x += height;
+            y = 0;
+        } else {
+            x = 0;
+            y += width;
+        }
+    }
+
+    // More than 95% of the samples unchanged means flat content.
+    if (!samples || stats[0] * 33 / samples >= 95)
+        return false;
+
+    quint64 error = 0;
+    for (int i = 1; i < 8; ++i) {
+        error += quint64(stats[i]) * i * i;
+        if (stats[i] == 0 || stats[i] > stats[i - 1] * 2)
+            return false;
+    }
+    for (int i = 8; i < 256; ++i)
+        error += quint64(stats[i]) * i * i;
+    error /= samples * 3 - stats[0];
+
+    return error < MaxAverageError;
+}
+
+template <class T>
+inline uchar *QRfbTightEncoder::writeTPixel(uchar *out, T pixel) const
+{
+    if (m_tpixel24) {
+        // TPIXEL is sent as R, G, B regardless of the client's shifts
+        const QRfbPixelFormat &format = client->pixelFormat();
+        const quint32 p = m_swapPixel ? qbswap(quint32(pixel)) : quint32(pixel);
+        out[0] = uchar(p >> format.redShift);
+        out[1] = uchar(p >> format.greenShift);
+        out[2] = uchar(p >> format.blueShift);
+        return out + 3;
+    }
+    memcpy(out, &pixel, sizeof(T));
+    return out + sizeof(T);
+}
+
+template <class T>
+QRfbTightEncoder::RectType QRfbTightEncoder::classify(const uchar *pixels, qsizetype stride,
+                                                      int width, int height)
+{
+    // Palettes pay off as long as the index data stays well below the size
+    // of the full colour pixels; tiny rects rarely have more than a few colours.
+    const int maxColors = qBound(2, width * height / 4, int(QRfbPalette::MaxColors));
+    m_palette.clear(maxColors);
+    forEachPixelRun<T>(pixels, stride, width, height, T(m_pixelMask), [this](T color, int) {
+        m_palette.insert(color);
+    });
+
+    if (m_palette.overflowed())
+        return FullColorRect;
+    switch (m_palette.size()) {
+    case 1:
+        return SolidRect;
+    case 2:
+        return MonoRect;
+    default:
+        return IndexedRect;
+    }
+}
+
+void QRfbTightEncoder::appendCompactLength(QByteArray *out, qsizetype length)
+{
+    uchar bytes[3];
+    int count = 0;
+    bytes[count++] = uchar(length & 0x7f);
+    if (length > 0x7f) {
+        bytes[0] |= 0x80;
+        bytes[count++] = uchar((length >> 7) & 0x7f);
+        if (length > 0x3fff) {
+            bytes[1] |= 0x80;
+            bytes[count++] = uchar((length >> 14) & 0xff);
+        }
+    }
+    out->append(reinterpret_cast<const char *>(bytes), count);
+}
+
+bool QRfbTightEncoder::writeBasic(QIODevice *socket, const QRect &rect, int stream,
+                                  QByteArray *header, qsizetype dataSize)
+{
+    const char *data = m_dataBuffer.constData();
+    qsizetype length = dataSize;
+
+    if (dataSize >= MinCompressSize) {
+        QRfbZlibStream &zlibStream = m_streams[stream];
+        // A fresh (or failed and reinitialized) stream must be reset on the
+        // client side as well.
+        if (!zlibStream.isInitialized())
+            (*header)[0] = char((*header)[0] | (1 << stream));
+        if (!zlibStream.compress(data, dataSize, &length))
+            return false;
+        data = zlibStream.compressedData();
+        appendCompactLength(header, length);
+    }
+
+    writeRectHeader(socket, rect, m_encoding);
+    socket->write(*header);
+    socket->write(data, length);
+    return true;
+}
+
+#ifdef QNOVNC_HAVE_JPEG
+namespace {
+struct QNoVncJpegErrorManager
+{
+    jpeg_error_mgr pub;
+    jmp_buf setjmpBuffer;
+};
+
+struct QNoVncJpegDestination
+{
+    jpeg_destination_mgr pub;
+    QByteArray *buffer;
+};
+}
+
+extern "C" {
+static void qnovnc_jpeg_error_exit(j_common_ptr cinfo)
+{
+    char message[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, message);
+    qWarning(lcVnc) << "JPEG compression failed:" << message;
+    longjmp(reinterpret_cast<QNoVncJpegErrorManager *>(cinfo->err)->setjmpBuffer, 1);
+}
+
+static void qnovnc_jpeg_init_destination(j_compress_ptr cinfo)
+{
+    QNoVncJpegDestination *dest = reinterpret_cast<QNoVncJpegDestination *>(cinfo->dest);
+    dest->pub.next_output_byte = reinterpret_cast<JOCTET *>(dest->buffer->data());
+    dest->pub.free_in_buffer = size_t(dest->buffer->size());
+}
+
+static boolean qnovnc_jpeg_empty_output_buffer(j_compress_ptr cinfo)
+{
+    // The whole buffer is full; keep it and continue behind it.
+    QNoVncJpegDestination *dest = reinterpret_cast<QNoVncJpegDestination *>(cinfo->dest);
+    const qsizetype used = dest->buffer->size();
+    dest->buffer->resize(used * 2);
+    dest->pub.next_output_byte = reinterpret_cast<JOCTET *>(dest->buffer->data()) + used;
+    dest->pub.free_in_buffer = size_t(dest->buffer->size() - used);
+    return TRUE;
+}
+
+static void qnovnc_jpeg_term_destination(j_compress_ptr)
+{
+}
+}
+
+// Compresses rect of image into out and returns the JPEG size, 0 on failure.
+static qsizetype compressJpeg(const QImage &image, const QRect &rect, int quality, QByteArray *out)
+{
+    QImage converted;
+    const uchar *rows = nullptr;
+    qsizetype stride = 0;
+    J_COLOR_SPACE colorSpace = JCS_RGB;
+    int components = 3;
+
+    switch (image.format()) {
+#ifdef JCS_EXTENSIONS
+    // libjpeg-turbo reads the 32-bit screen formats directly
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBA8888_Premultiplied:
+        colorSpace = JCS_EXT_RGBX;
+        components = 4;
+        break;
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+        colorSpace = (Q_BYTE_ORDER == Q_LITTLE_ENDIAN) ? JCS_EXT_BGRX : JCS_EXT_XRGB;
+        components = 4;
+        break;
+#endif
+    default:
+        converted = image.copy(rect).convertToFormat(QImage::Format_RGB888);
+        rows = converted.constBits();
+        stride = converted.bytesPerLine();
+        break;
+    }
+    if (!rows) {
+        rows = image.constScanLine(rect.y()) + rect.x() * 4;
+        stride = image.bytesPerLine();
+    }
+
+    const qsizetype initialSize = qMax(qsizetype(4096), qsizetype(rect.width()) * rect.height() / 2);
+    if (out->size() < initialSize)
+        out->resize(initialSize);
+
+    jpeg_compress_struct cinfo;
+    QNoVncJpegErrorManager jerr;
+    QNoVncJpegDestination dest;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = qnovnc_jpeg_error_exit;
+    if (setjmp(jerr.setjmpBuffer)) {
+        jpeg_destroy_compress(&cinfo);
+        return 0;
+    }
+
+    jpeg_create_compress(&cinfo);
+    dest.pub.init_destination = qnovnc_jpeg_init_destination;
+    dest.pub.empty_output_buffer = qnovnc_jpeg_empty_output_buffer;
+    dest.pub.term_destination = qnovnc_jpeg_term_destination;
+    dest.buffer = out;
+    cinfo.dest = &dest.pub;
+
+    cinfo.image_width = JDIMENSION(rect.width());
+    cinfo.image_height = JDIMENSION(rect.height());
+    cinfo.input_components = components;
+    cinfo.in_color_space = colorSpace;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.dct_method = JDCT_FASTEST;
+
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = const_cast<JSAMPROW>(rows + qsizetype(cinfo.next_scanline) * stride);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+
+    const qsizetype size = out->size() - qsizetype(dest.pub.free_in_buffer);
+    jpeg_destroy_compress(&cinfo);
+    return size;
+}
+#endif
+
+bool QRfbTightEncoder::writeJpeg(QIODevice *socket, const QImage &screenImage, const QRect &rect)
+{
+#ifdef QNOVNC_HAVE_JPEG
+    // JPEG works on the screen pixels; the client converts the decoded RGB.
+    const qsizetype size = compressJpeg(screenImage, rect, m_jpegQuality, &m_jpegBuffer);
+    if (!size)
+        return false;
+
+    m_header.clear();
+    m_header.append(char(JpegCompression));
+    appendCompactLength(&m_header, size);
+    writeRectHeader(socket, rect, m_encoding);
+    socket->write(m_header);
+    socket->write(m_jpegBuffer.constData(), size);
+    client->markLossy(rect);
+    return true;
+#else
+    Q_UNUSED(socket);
+    Q_UNUSED(screenImage);
+    Q_UNUSED(rect);
+    return false;
+#endif
+}
+
+template <class T>
+void QRfbTightEncoder::writeIndices(uchar *out, qsizetype outStride, const uchar *pixels,
+                                    qsizetype stride, int width, int height) const
+{
+    // Two colours are packed to one bit per pixel, MSB first, anything else
+    // takes a byte per pixel.
+    const bool mono = m_palette.size() == 2;
+    const T mask = T(m_pixelMask);
+    T lastColor = T(m_palette.color(0));
+    uint lastIndex = 0;
+    for (int y = 0; y < height; ++y) {
+        const T *row = reinterpret_cast<const T *>(pixels + y * stride);
+        uchar *dst = out + y * outStride;
+        uint byte = 0;
+        int used = 0;
+        for (int x = 0; x < width; ++x) {
+            const T p = row[x] & mask;
+            if (p != lastColor) {
+                lastColor = p;
+                lastIndex = uint(m_palette.indexOf(p));
+            }
+            if (mono) {
+                byte = (byte << 1) | lastIndex;
+                if (++used == 8) {
+                    *dst++ = uchar(byte);
+                    byte = 0;
+                    used = 0;
+                }
+            } else {
+                *dst++ = uchar(lastIndex);
+            }
+        }
+        if (used)
+            *dst = uchar(byte << (8 - used));
+    }
+}
+
+template <class T>
+bool QRfbTightEncoder::writePng(QIODevice *socket, const QImage &screenImage, const QRect &rect,
+                                RectType type, const uchar *pixels, qsizetype stride)
+{
+    if (!client->pixelFormat().trueColor)
+        return false;
+
+    QImage image;
+    if (type == FullColorRect) {
+        image = screenImage.copy(rect).convertToFormat(QImage::Format_RGB888);
+    } else {
+        // Palette rects become indexed PNGs, much smaller than RGB ones
+        image = QImage(rect.size(), type == MonoRect ? QImage::Format_Mono
+                                                     : QImage::Format_Indexed8);
+        const int paletteSize = m_palette.size();
+        QVector<QRgb> colors(paletteSize);
+        for (int i = 0; i < paletteSize; ++i) {
+            int rgb[3];
+            colorComponents<T>(T(m_palette.color(i)), rgb);
+            colors[i] = qRgb(rgb[0], rgb[1], rgb[2]);
+        }
+        image.setColorTable(colors);
+        writeIndices<T>(image.bits(), image.bytesPerLine(), pixels, stride,
+                        rect.width(), rect.height());
+    }
+
+    m_pngBuffer.clear();
+    QBuffer buffer(&m_pngBuffer);
+    buffer.open(QIODevice::WriteOnly);
+    QImageWriter writer(&buffer, "png");
+    // The PNG handler maps quality 100..9 onto zlib levels 0..9
+    writer.setQuality(100 - (client->compressionLevel() * 91 + 8) / 9);
+    if (!writer.write(image)) {
+        qWarning(lcVnc) << "PNG compression failed:" << writer.errorString();
+        return false;
+    }
+
+    m_header.clear();
+    m_header.append(char(PngCompression));
+    appendCompactLength(&m_header, m_pngBuffer.size());
+    writeRectHeader(socket, rect, m_encoding);
+    socket->write(m_header);
+    socket->write(m_pngBuffer);
+    return true;
+}
+
+template <class T>
+bool QRfbTightEncoder::writeTightRect(QIODevice *socket, const QImage &screenImage, const QRect &rect,
+                                      const uchar *pixels, qsizetype stride)
+{
+    const int width = rect.width();
+    const int height = rect.height();
+    const RectType type = classify<T>(pixels, stride, width, height);
+
+    uchar tpixel[4];
+    m_header.clear();
+
+    if (type == SolidRect) {
+        m_header.append(char(FillCompression));
+        m_header.append(reinterpret_cast<const char *>(tpixel),
+                        writeTPixel<T>(tpixel, T(m_palette.color(0))) - tpixel);
+        writeRectHeader(socket, rect, m_encoding);
+        socket->write(m_header);
+        return true;
+    }
+
+    if (type == FullColorRect && m_jpegQuality >= 0
+        && isSmooth<T>(pixels, stride, width, height)
+        && writeJpeg(socket, screenImage, rect)) {
+        return true;
+    }
+
+    if (m_encoding == TightPngEncoding)
+        return writePng<T>(socket, screenImage, rect, type, pixels, stride);
+
+    if (type == FullColorRect) {
+        const qsizetype dataSize = qsizetype(width) * height * m_tpixelSize;
+        if (m_dataBuffer.size() < dataSize)
+            m_dataBuffer.resize(dataSize);
+        uchar *out = reinterpret_cast<uchar *>(m_dataBuffer.data());
+        for (int y = 0; y < height; ++y) {
+            const T *row = reinterpret_cast<const T *>(pixels + y * stride);
+            for (int x = 0; x < width; ++x)
+                out = writeTPixel<T>(out, row[x]);
+        }
+        m_header.append(char(FullColorStream << 4));
+        return writeBasic(socket, rect, FullColorStream, &m_header, dataSize);
+    }
+
+    const int paletteSize = m_palette.size();
+    const int stream = (type == MonoRect) ? MonoStream : IndexedStream;
+    m_header.append(char((stream << 4) | ExplicitFilter));
+    m_header.append(char(PaletteFilter));
+    m_header.append(char(paletteSize - 1));
+    for (int i = 0; i < paletteSize; ++i) {
+        m_header.append(reinterpret_cast<const char *>(tpixel),
+                        writeTPixel<T>(tpixel, T(m_palette.color(i))) - tpixel);
+    }
+
+    const qsizetype rowBytes = (type == MonoRect) ? (width + 7) / 8 : width;
+    const qsizetype dataSize = rowBytes * height;
+    if (m_dataBuffer.size() < dataSize)
+        m_dataBuffer.resize(dataSize);
+    writeIndices<T>(reinterpret_cast<uchar *>(m_dataBuffer.data()), rowBytes,
+                    pixels, stride, width, height);
+
+    return writeBasic(socket, rect, stream, &m_header, dataSize);
+}
+
+void QRfbTightEncoder::beginUpdate()
+{
+    setupTPixel();
+}
+
+void QRfbTightEncoder::writeRect(QIODevice *socket, const QImage &screenImage, const QRect &rect)
+{
+    qsizetype stride = 0;
+    const uchar *pixels = clientPixels(screenImage, rect, &m_pixelBuffer, &stride);
+
+    bool written = false;
+    switch (client->clientBytesPerPixel()) {
+    case 1:
+        written = writeTightRect<quint8>(socket, screenImage, rect, pixels, stride);
+        break;
+    case 2:
+        written = writeTightRect<quint16>(socket, screenImage, rect, pixels, stride);
+        break;
+    case 4:
+        written = writeTightRect<quint32>(socket, screenImage, rect, pixels, stride);
+        break;
+    }
+    if (!written)
+        writeRawRect(socket, rect, pixels, stride);
+}
+
+// Copies the masked pixels of a block to work, workStride pixels apart,
+// so that covered pixels can be cleared to the background later, and
+// returns the background, picked by a majority vote on the way.
+template <class T>
+static inline T copyForSubrects(T *work, qsizetype workStride, const uchar *pixels,
+                                qsizetype stride, int width, int height, T mask)
+{
+    T bg = 0;
+    int votes = 0;
+    for (int y = 0; y < height; ++y) {
+        const T *row = reinterpret_cast<const T *>(pixels + y * stride);
+        T *dst = work + y * workStride;
+        for (int x = 0; x < width; ++x) {
+            const T p = row[x] & mask;
+            dst[x] = p;
+            if (!votes)
+                bg = p;
+            votes += (p == bg) ? 1 : -1;
+        }
+    }
+    return bg;
+}
+
+// Calls func(color, x, y, w, h) for subrects covering every pixel of work
+// that is not bg, clearing the covered pixels to bg. Stops and returns
+// false as soon as func does.
+template <class T, class Func>
+static inline bool forEachSubrect(T *work, qsizetype workStride, int width, int height,
+                                  T bg, Func func)
+{
+    for (int y = 0; y < height; ++y) {
+        T *row = work + y * workStride;
+        for (int x = 0; x < width; ++x) {
+            const T color = row[x];
+            if (color == bg)
+                continue;
+
+            int w = 1;
+            while (x + w < width && row[x + w] == color)
+                ++w;
+            int h = 1;
+            for (; y + h < height; ++h) {
+                const T *below = row + h * workStride + x;
+                int i = 0;
+                while (i < w && below[i] == color)
+                    ++i;
+                if (i < w)
+                    break;
+            }
+
+            if (!func(color, x, y, w, h))
+                return false;
+
+            for (int i = 1; i < h; ++i)
+                std::fill_n(row + i * workStride + x, w, bg);
+            x += w - 1;
+        }
+    }
+    return true;
+}
+
+template <class T>
+bool QRfbRreEncoder::writeRreRect(QIODevice *socket, const QRect &rect,
+                                  const uchar *pixels, qsizetype stride)
+{
+    const int width = rect.width();
+    const int height = rect.height();
+    const int bpp = sizeof(T);
+    const bool compact = m_encoding == CoRreEncoding;
+    const int subrectSize = bpp + (compact ? 4 : 8);
+    const int headerSize = 4 + bpp;
+    const qsizetype rawSize = qsizetype(width) * height * bpp;
+    if (rawSize <= headerSize)
+        return false;
+
+    if (m_workBuffer.size() < rawSize)
+        m_workBuffer.resize(rawSize);
+    T *work = reinterpret_cast<T *>(m_workBuffer.data());
+    const T bg = copyForSubrects<T>(work, width, pixels, stride, width, height, T(m_pixelMask));
+
+    // Give up as soon as the raw pixels would be as small
+    const qsizetype maxSubrects = (rawSize - headerSize) / subrectSize;
+    if (m_dataBuffer.size() < rawSize)
+        m_dataBuffer.resize(rawSize);
+    uchar *data = reinterpret_cast<uchar *>(m_dataBuffer.data());
+    uchar *out = data + headerSize;
+    qsizetype count = 0;
+
+    const bool fits = forEachSubrect<T>(work, width, width, height, bg,
+                                        [&](T color, int x, int y, int w, int h) {
+        if (++count > maxSubrects)
+            return false;
+        memcpy(out, &color, bpp);
+        out += bpp;
+        if (compact) {
+            *out++ = uchar(x);
+            *out++ = uchar(y);
+            *out++ = uchar(w);
+            *out++ = uchar(h);
+        } else {
+            qToBigEndian<quint16>(quint16(x), out);
+            qToBigEndian<quint16>(quint16(y), out + 2);
+            qToBigEndian<quint16>(quint16(w), out + 4);
+            qToBigEndian<quint16>(quint16(h), out + 6);
+            out += 8;
+        }
+        return true;
+    });
+    if (!fits)
+        return false;
+
+    qToBigEndian<quint32>(quint32(count), data);
+    memcpy(data + 4, &bg, bpp);
+    writeRectHeader(socket, rect, m_encoding);
+    socket->write(reinterpret_cast<const char *>(data), out - data);
+    return true;
+}
+
+void QRfbRreEncoder::beginUpdate()
+{
+    m_pixelMask = clientPixelMask();
+}
+
+void QRfbRreEncoder::splitRect(const QRect &rect, QVector<QRect> *rects) const
+{
+    if (m_encoding != CoRreEncoding) {
+        rects->append(rect);
+        return;
+    }
+    for (int y = rect.y(); y <= rect.bottom(); y += MaxCoRreSize) {
+        for (int x = rect.x(); x <= rect.right(); x += MaxCoRreSize) {
+            rects->append(QRect(x, y, qMin(int(MaxCoRreSize), rect.right() - x + 1),
+                                qMin(int(MaxCoRreSize), rect.bottom() - y + 1)));
+        }
+    }
+}
+
+void QRfbRreEncoder::writeRect(QIODevice *socket, const QImage &screenImage, const QRect &rect)
+{
+    qsizetype stride = 0;
+    const uchar *pixels = clientPixels(screenImage, rect, &m_pixelBuffer, &stride);
+
+    bool written = false;
+    switch (client->clientBytesPerPixel()) {
+    case 1:
+        written = writeRreRect<quint8>(socket, rect, pixels, stride);
+        break;
+    case 2:
+        written = writeRreRect<quint16>(socket, rect, pixels, stride);
+        break;
+    case 4:
+        written = writeRreRect<quint32>(socket, rect, pixels, stride);
+        break;
+    }
+    if (!written)
+        writeRawRect(socket, rect, pixels, stride);
+}
+
+template <class SRC>
+bool QRfbSingleColorHextile<SRC>::read(const uchar *data, int width, int height, int stride)
+{
+    const SRC mask = encoder->pixelMask;
+    const SRC color = *reinterpret_cast<const SRC *>(data) & mask;
+    for (int y = 0; y < height; ++y) {
+        const SRC *row = reinterpret_cast<const SRC *>(data + y * stride);
+        for (int x = 0; x < width; ++x) {
+            if ((row[x] & mask) != color)
+                return false;
+        }
+    }
+
+    encoder->newBg = !encoder->validBg || color != encoder->bg;
+    encoder->bg = color;
+    encoder->validBg = true;
+    return true;
+}
+
+template <class SRC>
+void QRfbSingleColorHextile<SRC>::write(QByteArray *out) const
+{
+    if (encoder->newBg) {
+        out->append(char(QRfbHextileEncoder<SRC>::BackgroundSpecified));
+        out->append(reinterpret_cast<const char *>(&encoder->bg), sizeof(SRC));
+    } else {
+        out->append(char(0));
+    }
+}
+
+template <class SRC>
+bool QRfbDualColorHextile<SRC>::read(const uchar *data, int width, int height, int stride)
+{
+    const SRC mask = encoder->pixelMask;
+    const SRC first = *reinterpret_cast<const SRC *>(data) & mask;
+    SRC second = first;
+    int firstCount = 0;
+    int secondCount = 0;
+
+    // one bit per pixel that differs from the first colour
+    quint16 bits[MAP_TILE_SIZE];
+    for (int y = 0; y < height; ++y) {
+        const SRC *row = reinterpret_cast<const SRC *>(data + y * stride);
+        uint rowBits = 0;
+        for (int x = 0; x < width; ++x) {
+            const SRC p = row[x] & mask;
+            if (p == first) {
+                ++firstCount;
+                continue;
+            }
+            if (!secondCount)
+                second = p;
+            else if (p != second)
+                return false;
+            ++secondCount;
+            rowBits |= 1u << x;
+        }
+        bits[y] = quint16(rowBits);
+    }
+    if (!secondCount)
+        return false;
+
+    // The more frequent colour becomes the background
+    const bool firstIsBg = firstCount >= secondCount;
+    const SRC bg = firstIsBg ? first : second;
+    const SRC fg = firstIsBg ? second : first;
+    if (!firstIsBg) {
+        const quint16 rowMask = quint16((1u << width) - 1);
+        for (int y = 0; y < height; ++y)
+            bits[y] = ~bits[y] & rowMask;
+    }
+
+    const bool newBg = !encoder->validBg || bg != encoder->bg;
+    const bool newFg = !encoder->validFg || fg != encoder->fg;
+    const int bpp = sizeof(SRC);
+    const int headerSize = 2 + (newBg ? bpp : 0) + (newFg ? bpp : 0);
+    // Give up as soon as a raw tile would be as small
+    const int maxRects = qMin(int(sizeof(rects) / sizeof(Rect)),
+                              (width * height * bpp - headerSize) / 2);
+
+    numRects = 0;
+    for (int y = 0; y < height; ++y) {
+        while (bits[y]) {
+            const int x = qCountTrailingZeroBits(uint(bits[y]));
+            const int w = qCountTrailingZeroBits(~(uint(bits[y]) >> x));
+            const quint16 run = quint16(((1u << w) - 1) << x);
+            int h = 1;
+            while (y + h < height && (bits[y + h] & run) == run)
+                ++h;
+            if (numRects >= maxRects)
+                return false;
+            for (int i = 0; i < h; ++i)
+                bits[y + i] &= ~run;
+            setX(x);
+            setY(y);
+            setWidth(w);
+            setHeight(h);
+            next();
+        }
+    }
+
+    encoder->newBg = newBg;
+    encoder->newFg = newFg;
+    encoder->bg = bg;
+    encoder->fg = fg;
+    encoder->validBg = true;
+    encoder->validFg = true;
+    return true;
+}
+
+template <class SRC>
+void QRfbDualColorHextile<SRC>::next()
+{
+    ++numRects;
+}
+
+template <class SRC>
+void QRfbDualColorHextile<SRC>::write(QByteArray *out) const
+{
+    int subenc = QRfbHextileEncoder<SRC>::AnySubrects;
+    if (encoder->newBg)
+        subenc |= QRfbHextileEncoder<SRC>::BackgroundSpecified;
+    if (encoder->newFg)
+        subenc |= QRfbHextileEncoder<SRC>::ForegroundSpecified;
+    out->append(char(subenc));
+    if (encoder->newBg)
+        out->append(reinterpret_cast<const char *>(&encoder->bg), sizeof(SRC));
+    if (encoder->newFg)
+        out->append(reinterpret_cast<const char *>(&encoder->fg), sizeof(SRC));
+    out->append(char(numRects));
+    out->append(reinterpret_cast<const char *>(rects), numRects * sizeof(Rect));
+}
+
+template <class SRC>
+bool QRfbMultiColorHextile<SRC>::read(const uchar *data, int width, int height, int stride)
+{
+    SRC tile[MAP_TILE_SIZE * MAP_TILE_SIZE];
+    const SRC bg = copyForSubrects<SRC>(tile, MAP_TILE_SIZE, data, stride, width, height,
+                                        encoder->pixelMask);
+
+    const bool newBg = !encoder->validBg || bg != encoder->bg;
+    bpp = sizeof(SRC);
+    maxRects = (width * height * bpp - 2 - (newBg ? bpp : 0)) / (bpp + 2);
+    numRects = 0;
+    rects.resize(0);
+
+    const bool fits = forEachSubrect<SRC>(tile, MAP_TILE_SIZE, width, height, bg,
+                                          [this](SRC color, int x, int y, int w, int h) {
+        if (!beginRect())
+            return false;
+        setColor(color);
+        setX(numRects, x);
+        setY(numRects, y);
+        setWidth(numRects, w);
+        setHeight(numRects, h);
+        endRect();
+        return true;
+    });
+    if (!fits)
+        return false;
+
+    encoder->newBg = newBg;
+    encoder->bg = bg;
+    encoder->validBg = true;
+    encoder->validFg = false;
+    return true;
+}
+
+template <class SRC>
+void QRfbMultiColorHextile<SRC>::setColor(SRC color)
+{
+    memcpy(rect(numRects), &color, bpp);
+}
+
+template <class SRC>
+bool QRfbMultiColorHextile<SRC>::beginRect()
+{
+    if (numRects >= maxRects)
+        return false;
+    rects.resize((numRects + 1) * (bpp + 2));
+    return true;
+}
+
+template <class SRC>
+void QRfbMultiColorHextile<SRC>::endRect()
+{
+    ++numRects;
+}
+
+template <class SRC>
+void QRfbMultiColorHextile<SRC>::write(QByteArray *out) const
+{
+    int subenc = QRfbHextileEncoder<SRC>::AnySubrects
+                 | QRfbHextileEncoder<SRC>::SubrectsColoured;
+    if (encoder->newBg)
+        subenc |= QRfbHextileEncoder<SRC>::BackgroundSpecified;
+    out->append(char(subenc));
+    if (encoder->newBg)
+        out->append(reinterpret_cast<const char *>(&encoder->bg), sizeof(SRC));
+    out->append(char(numRects));
+    out->append(reinterpret_cast<const char *>(rects.constData()), numRects * (bpp + 2));
+}
+
+template <class SRC>
+QRfbHextileEncoder<SRC>::QRfbHextileEncoder(QNoVncClient *s)
+    : QRfbEncoder(s),
+      singleColorHextile(this), dualColorHextile(this), multiColorHextile(this),
+      pixelMask(0), bg(0), fg(0), newBg(false), newFg(false), validBg(false), validFg(false),
+      formatMatches(false)
+{
+}
+
+template <class SRC>
+void QRfbHextileEncoder<SRC>::writeRawTile(QByteArray *out, const uchar *data,
+                                           int width, int height, int stride)
+{
+    out->append(char(Raw));
+    for (int y = 0; y < height; ++y)
+        out->append(reinterpret_cast<const char *>(data + y * stride), width * sizeof(SRC));
+    validBg = false;
+    validFg = false;
+}
+
+template <class SRC>
+void QRfbHextileEncoder<SRC>::beginUpdate()
+{
+    formatMatches = client->clientBytesPerPixel() == int(sizeof(SRC));
+    pixelMask = SRC(clientPixelMask());
+}
+
+template <class SRC>
+void QRfbHextileEncoder<SRC>::writeRect(QIODevice *socket, const QImage &screenImage, const QRect &rect)
+{
+    qsizetype stride = 0;
+    const uchar *pixels = clientPixels(screenImage, rect, &buffer, &stride);
+    if (!formatMatches) {
+        writeRawRect(socket, rect, pixels, stride);
+        return;
+    }
+
+    // Collect the whole rectangle, every device write is a websocket frame
+    tileData.clear();
+    validBg = false;
+    validFg = false;
+    for (int y = 0; y < rect.height(); y += MAP_TILE_SIZE) {
+        const int height = qMin(MAP_TILE_SIZE, rect.height() - y);
+        for (int x = 0; x < rect.width(); x += MAP_TILE_SIZE) {
+            const int width = qMin(MAP_TILE_SIZE, rect.width() - x);
+            const uchar *data = pixels + y * stride + x * qsizetype(sizeof(SRC));
+            if (singleColorHextile.read(data, width, height, int(stride)))
+                singleColorHextile.write(&tileData);
+            else if (dualColorHextile.read(data, width, height, int(stride)))
+                dualColorHextile.write(&tileData);
+            else if (multiColorHextile.read(data, width, height, int(stride)))
+                multiColorHextile.write(&tileData);
+            else
+                writeRawTile(&tileData, data, width, height, int(stride));
+        }
+    }
+
+    writeRectHeader(socket, rect, 5); // hextile encoding
+    socket->write(tileData);
+}
+
+template class QRfbHextileEncoder<quint8>;
+template class QRfbHextileEncoder<quint16>;
+template class QRfbHextileEncoder<quint32>;
+
+template <class E>
+static QRfbEncoder *createEncoder(QNoVncClient *client)
+{
+    return new E(client);
+}
+
+static QRfbEncoder *createHextileEncoder(QNoVncClient *client)
+{
+    switch (client->clientBytesPerPixel()) {
+    case 1:
+        return new QRfbHextileEncoder<quint8>(client);
+    case 2:
+        return new QRfbHextileEncoder<quint16>(client);
+    case 4:
+        return new QRfbHextileEncoder<quint32>(client);
+    }
+    return nullptr;
+}
+
+static const QRfbEncoderFactory encoderFactories[] = {
+    { 0, "raw", QRfbEncoderFactory::PerRect, nullptr, createEncoder<QRfbRawEncoder> },
+    { 2, "rre", QRfbEncoderFactory::PerRect, nullptr, createEncoder<QRfbRreEncoder> },
+    { 4, "corre", QRfbEncoderFactory::PerRect, nullptr, createEncoder<QRfbCoRreEncoder> },
+    { 5, "hextile", QRfbEncoderFactory::PerRect | QRfbEncoderFactory::PixelSizeSpecific,
+      nullptr, createHextileEncoder },
+    { 6, "zlib", QRfbEncoderFactory::PerRect, nullptr, createEncoder<QRfbZlibEncoder> },
+    { 7, "tight", QRfbEncoderFactory::PerRect, nullptr, createEncoder<QRfbTightEncoder> },
+    { 16, "zrle", QRfbEncoderFactory::PerRect, nullptr, createEncoder<QRfbZrleEncoder> },
+    // Clients normally list TightPNG after Tight; thin clients that decode
+    // PNG natively may be better off with it anyway.
+    { -260, "tightpng", QRfbEncoderFactory::PerRect, "QNOVNC_PREFER_TIGHTPNG",
+      createEncoder<QRfbTightPngEncoder> },
+#ifdef QNOVNC_HAVE_H264
+    // noVNC lists H.264 after the lossless encodings, so video heavy
+    // screens have to ask for it explicitly.
+    { 50, "h264", 0, "QNOVNC_PREFER_H264", createEncoder<QRfbH264Encoder> },
+#endif
+};
+
+const QRfbEncoderFactory *QRfbEncoderFactory::find(qint32 encoding)
+{
+    for (const QRfbEncoderFactory &factory : encoderFactories) {
+        if (factory.encoding == encoding)
+            return &factory;
+    }
+    return nullptr;
+}
+
+const QRfbEncoderFactory *QRfbEncoderFactory::find(const QByteArray &name)
+{
+    for (const QRfbEncoderFactory &factory : encoderFactories) {
+        if (qstricmp(name.constData(), factory.name) == 0)
+            return &factory;
+    }
+    return nullptr;
+}
+
+QRfbAdaptiveEncoder::QRfbAdaptiveEncoder(QNoVncClient *s)
+    : QRfbEncoder(s)
+{
+    std::fill_n(m_classEncoders, int(RectClassCount), nullptr);
+}
+
+void QRfbAdaptiveEncoder::setEncodings(const QVector<qint32> &encodings)
+{
+    // Cheapest first for each class; raw, which every client supports,
+    // ends each list.
+    static const qint32 preferences[RectClassCount][8] = {
+        { RawEncoding },
+        { TightEncoding, TightPngEncoding, RreEncoding, CoRreEncoding, HextileEncoding,
+          ZrleEncoding, ZlibEncoding, RawEncoding },
+        { TightEncoding, TightPngEncoding, ZrleEncoding, HextileEncoding, CoRreEncoding,
+          RreEncoding, ZlibEncoding, RawEncoding },
+        { TightEncoding, ZrleEncoding, TightPngEncoding, ZlibEncoding, HextileEncoding,
+          RawEncoding },
+        { TightEncoding, TightPngEncoding, ZrleEncoding, ZlibEncoding, RawEncoding }
+    };
+
+    for (int i = 0; i < RectClassCount; ++i) {
+        m_classEncoders[i] = nullptr;
+        for (const qint32 candidate : preferences[i]) {
+            if (candidate != RawEncoding && !encodings.contains(candidate))
+                continue;
+            m_classEncoders[i] = client->encoder(candidate);
+            if (m_classEncoders[i])
+                break;
+        }
+    }
+}
+
+template <class T>
+void QRfbAdaptiveEncoder::samplePixels(const QImage &screenImage, const QRect &rect, int step)
+{
+    for (int y = rect.top(); y <= rect.bottom(); y += step) {
+        const T *row = reinterpret_cast<const T *>(screenImage.constScanLine(y));
+        for (int x = rect.left(); x <= rect.right(); x += step) {
+            if (!m_palette.insert(row[x]))
+                return;
+        }
+    }
+}
+
+QRfbAdaptiveEncoder::RectClass QRfbAdaptiveEncoder::classify(const QImage &screenImage,
+                                                            const QRect &rect)
+{
+    // Below this the rect header and the compression framing dominate
+    const qsizetype pixelCount = qsizetype(rect.width()) * rect.height();
+    if (pixelCount * client->clientBytesPerPixel() <= MaxRawBytes)
+        return TinyRect;
+
+    // A grid sample keeps large rects as cheap to judge as small ones
+    const int step = qMax(1, int(std::sqrt(double(pixelCount) / SamplePixels)));
+    m_palette.clear(QRfbPalette::MaxColors);
+    switch (screenImage.depth()) {
+    case 8:
+        samplePixels<quint8>(screenImage, rect, step);
+        break;
+    case 16:
+        samplePixels<quint16>(screenImage, rect, step);
+        break;
+    case 32:
+        samplePixels<quint32>(screenImage, rect, step);
+        break;
+    default:
+        return DetailedRect;
+    }
+
+    if (m_palette.overflowed())
+        return PhotoRect;
+    if (m_palette.size() == 1)
+        return SolidRect;
+    return m_palette.size() <= MaxFlatColors ? FlatRect : DetailedRect;
+}
+
+void QRfbAdaptiveEncoder::write()
+{
+    QIODevice *socket = client->clientSocket();
+    QRegion rgn = client->dirtyRegion();
+    qCDebug(lcVnc) << "QRfbAdaptiveEncoder::write()" << rgn;
+
+    const QImage screenImage = updateImage(&rgn);
+    findDuplicateTiles(screenImage, &rgn);
+
+    m_rects.clear();
+    m_rectEncoders.clear();
+    for (const QRect &rect : rgn) {
+        QRfbEncoder *e = m_classEncoders[classify(screenImage, rect)];
+        e->splitRect(rect, &m_rects);
+        while (m_rectEncoders.size() < m_rects.size())
+            m_rectEncoders.append(e);
+    }
+    writeUpdateHeader(socket, m_rects.size());
+
+    beginUpdate();
+    for (qsizetype i = 0; i < m_rects.size(); ++i)
+        m_rectEncoders.at(i)->writeRect(socket, screenImage, m_rects.at(i));
+    writeTileCopies(socket);
+}
+
+void QRfbAdaptiveEncoder::beginUpdate()
+{
+    for (int i = 0; i < RectClassCount; ++i) {
+        QRfbEncoder *e = m_classEncoders[i];
+        if (std::find(m_classEncoders, m_classEncoders + i, e) == m_classEncoders + i)
+            e->beginUpdate();
+    }
+}
+
+void QRfbAdaptiveEncoder::writeRect(QIODevice *socket, const QImage &screenImage, const QRect &rect)
+{
+    m_classEncoders[classify(screenImage, rect)]->writeRect(socket, screenImage, rect);
+}
+
+#if QT_CONFIG(cursor)
+QNoVncClientCursor::QNoVncClientCursor()
+{
+    QWindow *w = QGuiApplication::focusWindow();
+    QCursor c = w ? w->cursor() : QCursor(Qt::ArrowCursor);
+    changeCursor(&c, nullptr);
+}
+
+QNoVncClientCursor::~QNoVncClientCursor()
+{
+}
+
+void QNoVncClientCursor::write(QNoVncClient *client) const
+{
+    QIODevice *socket = client->clientSocket();
+
+    // FramebufferUpdate header
+    {
+        const quint16 tmp[6] = { htons(0),
+                                 htons(1),
+                                 htons(static_cast<uint16_t>(hotspot.x())), htons(static_cast<uint16_t>(hotspot.y())),
+                                 htons(static_cast<uint16_t>(cursor.width())),
+                                 htons(static_cast<uint16_t>(cursor.height())) };
+        socket->write(reinterpret_cast<const char*>(tmp), sizeof(tmp));
+
+        const qint32 encoding = qToBigEndian(-239);
+        socket->write(reinterpret_cast<const char*>(&encoding), sizeof(encoding));
+    }
+
+    if (cursor.isNull())
+        return;
+
+    // write pixels
+    Q_ASSERT(cursor.hasAlphaChannel());
+    const QImage img = cursor.convertToFormat(client->server()->screen()->format());
+    const int n = client->clientBytesPerPixel() * img.width();
+    char *buffer = new char[n];
+    for (int i = 0; i < img.height(); ++i) {
+        client->convertPixels(buffer, (const char*)img.scanLine(i), img.width());
+        socket->write(buffer, n);
+    }
+    delete[] buffer;
+
+    // write mask
+    const QImage bitmap = cursor.createAlphaMask().convertToFormat(QImage::Format_Mono);
+    Q_ASSERT(bitmap.depth() == 1);
+    Q_ASSERT(bitmap.size() == img.size());
+    const int width = (bitmap.width() + 7) / 8;
+    for (int i = 0; i < bitmap.height(); ++i)
+        socket->write(reinterpret_cast<const char*>(bitmap.scanLine(i)), width);
+}
+
+void QNoVncClientCursor::changeCursor(QCursor *widgetCursor, QWindow *window)
+{
+    Q_UNUSED(window);
+    const Qt::CursorShape shape = widgetCursor ? widgetCursor->shape() : Qt::ArrowCursor;
+
+    if (shape == Qt::BitmapCursor) {
+        // application supplied cursor
+        hotspot = widgetCursor->hotSpot();
+        cursor = widgetCursor->pixmap().toImage();
+    } else {
+        // system cursor
+        QPlatformCursorImage platformImage(nullptr, nullptr, 0, 0, 0, 0);
+        platformImage.set(shape);
+        cursor = *platformImage.image();
+        hotspot = platformImage.hotspot();
+    }
+    for (auto client : std::as_const(clients))
+        client->setDirtyCursor();
+}
+
+void QNoVncClientCursor::addClient(QNoVncClient *client)
+{
+    if (!clients.contains(client)) {
+        clients.append(client);
+        // Force a cursor update when the client connects.
+        client->setDirtyCursor();
+    }
+}
+
+uint QNoVncClientCursor::removeClient(QNoVncClient *client)
+{
+    clients.removeOne(client);
+    return clients.size();
+}
+#endif // QT_CONFIG(cursor)
+
+QNoVncServer::QNoVncServer(QNoVncScreen *screen, quint16 port, QString host)
+    : QNoVnc_screen(screen)
+    , m_port(port)
     , m_host(std::move(host))
     , m_frameCache(new QNoVncFrameCache(this))
 {
@@ -775,14 +2443,53 @@ QNoVncServer::~QNoVncServer()
 
 void QNoVncServer::setDirty()
 {
-    m_frameCache->invalidate();
-    for (auto client : std::as_const(clients))
+    // Copied areas changed on the screen too, only not for the clients
+    m_frameCache->invalidate(QNoVnc_screen->dirtyRegion + QNoVnc_screen->copiedRegion);
+    for (auto client : std::as_const(clients)) {
+        if (!QNoVnc_screen->copiedRegion.isEmpty())
+            client->setCopied(QNoVnc_screen->copiedRegion, QNoVnc_screen->copyDelta);
         client->setDirty(QNoVnc_screen->dirtyRegion);
+    }
 
     QNoVnc_screen->clearDirty();
 }
 
 
+void QNoVncServer::updateScreenFormat()
+{
+    static const bool enabled = qEnvironmentVariableIntValue("QNOVNC_MATCH_CLIENT_FORMAT") == 1;
+    const QImage::Format current = QNoVnc_screen->image()->format();
+    if (!enabled || QNoVnc_screen->image()->depth() != 32)
+        return;
+
+    // The screen keeps its layout unless another one suits more clients
+    const QImage::Format candidates[] = { current, QImage::Format_RGBA8888, QImage::Format_ARGB32 };
+    int best = 0;
+    int bestVotes = -1;
+    for (int i = 0; i < 3; ++i) {
+        const QRfbPixelFormat format = QNoVncPixelConverter::screenFormat(candidates[i]);
+        int votes = 0;
+        for (const QNoVncClient *client : std::as_const(clients)) {
+            if (client->isConnected()
+                && QNoVncPixelConverter::sameLayout(client->pixelFormat(), format))
+                ++votes;
+        }
+        if (votes > bestVotes) {
+            best = i;
+            bestVotes = votes;
+        }
+    }
+    if (candidates[best] == current)
+        return;
+
+    qCDebug(lcVnc) << "Switching the screen image to" << candidates[best]
+                   << "for" << bestVotes << "of" << clients.size() << "clients";
+    QNoVnc_screen->setImageFormat(candidates[best]);
+    m_frameCache->invalidate();
+    for (QNoVncClient *client : std::as_const(clients))
+        client->updatePixelConversion();
+}
+
 void QNoVncServer::newConnection()
 {
     auto clientSocket = serverSocket->nextPendingConnection();
@@ -800,6 +2507,7 @@ void QNoVncServer::discardClient(QNoVncClient *client)
     clients.removeOne(client);
     QNoVnc_screen->disableClientCursor(client);
     client->deleteLater();
+    updateScreenFormat();
     if (clients.isEmpty())
         QNoVnc_screen->setPowerState(QPlatformScreen::PowerStateOff);
 }
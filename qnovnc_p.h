@@ -10,6 +10,7 @@
 #include <QtCore/QLoggingCategory>
 #include <QtCore/qbytearray.h>
 #include <QtCore/qvarlengtharray.h>
+#include <QtCore/qvector.h>
 #include <qpa/qplatformcursor.h>
 
 #include <QTimer>
@@ -31,16 +32,54 @@ class QNoVncFrameCache;
 // This fits with the VNC hextile messages
 #define MAP_TILE_SIZE 16
 
+// Damage tracking of the screen image: the only copy of the previous frame
+// and one map of MAP_TILE_SIZE tiles that changed since the clients were
+// last told, both filled by a single comparison pass per frame.
 class QNoVncDirtyMap
 {
 public:
     QNoVncDirtyMap(QNoVncScreen *screen);
     virtual ~QNoVncDirtyMap();
 
+    // A horizontal run of dirty tiles, in tiles
+    struct Run {
+        int x;
+        int y;
+        int length;
+    };
+    // Yields the dirty runs row by row; clean rows and words are skipped
+    // a word at a time, so a walk costs about the number of dirty runs.
+    class RunIterator
+    {
+    public:
+        explicit RunIterator(const QNoVncDirtyMap *map) : m_map(map) {}
+        bool next(Run *run);
+
+    private:
+        const QNoVncDirtyMap *m_map;
+        int m_row = -1;
+        int m_x = 0;
+    };
+
     void reset();
     bool dirty(int x, int y) const;
-    virtual void setDirty(int x, int y, bool force = false) = 0;
+    void setDirty(int x, int y);
     void setClean(int x, int y);
+    // Marks every tile clean once the changes went to the clients
+    void clear();
+
+    // Marks the tiles in touched whose pixels differ from the previous
+    // frame dirty and returns them. Tiles in trusted, and everything while
+    // there is no previous frame of the screen's size and format, count as
+    // changed without being compared.
+    QRegion compare(const QRegion &touched, const QRegion &trusted = QRegion());
+    // Copies the dirty tiles into the previous frame
+    void commit();
+    // Converts the previous frame along with the screen image, so that a
+    // change of layout alone does not count as a change
+    void setFormat(QImage::Format format);
+    const QImage &previousFrame() const { return shadow; }
+    bool hasPreviousFrame() const;
 
     QNoVncScreen *screen;
     int bytesPerPixel;
@@ -49,11 +88,25 @@ public:
     int mapHeight;
 
 protected:
-    uchar *map;
-    uchar *buffer;
+    virtual bool tileChanged(int tileX, int tileY) const = 0;
+    void resize(const QSize &size);
+    // First index from 'from' on whose bit equals set, or count when none
+    static int findBit(const quint64 *words, int from, int count, bool set);
+    // The tiles set in bits, laid out like map, as a region built in one
+    // pass: equal rows of runs are merged into bands and handed over as a
+    // ready banded rect list instead of being united one by one.
+    QRegion tileRegion(const QVector<quint64> &bits) const;
+
+    // One bit per tile, each row starting on a new word
+    QVector<quint64> map;
+    // One bit per row that has dirty tiles
+    QVector<quint64> rowSummary;
+    // The tiles found changed by the current compare(), laid out like map
+    QVector<quint64> changedTiles;
+    int wordsPerRow;
+    QImage shadow;
     int bufferWidth;
     int bufferHeight;
-    int bufferStride;
     int numTiles;
 };
 
@@ -64,7 +117,8 @@ public:
     QNoVncDirtyMapOptimized(QNoVncScreen *screen) : QNoVncDirtyMap(screen) {}
     ~QNoVncDirtyMapOptimized() {}
 
-    void setDirty(int x, int y, bool force = false) override;
+protected:
+    bool tileChanged(int tileX, int tileY) const override;
 };
 
 
@@ -106,6 +160,8 @@ public:
     void read(QIODevice *s);
     void write(QIODevice *s);
 
+    quint32 colorMask() const;
+
     int bitsPerPixel;
     int depth;
     bool bigEndian;
@@ -187,18 +243,168 @@ public:
     QRfbEncoder(QNoVncClient *s) : client(s) {}
     virtual ~QRfbEncoder() {}
 
-    virtual void write() = 0;
+    // Sends the client's dirty region as one FramebufferUpdate, built from
+    // the per-rect functions below.
+    virtual void write();
+
+    // Called once per update before the first writeRect().
+    virtual void beginUpdate() {}
+    // Appends the pieces rect is sent as; every piece gets its own header.
+    virtual void splitRect(const QRect &rect, QVector<QRect> *rects) const { rects->append(rect); }
+    // Writes one piece, including its rect header.
+    virtual void writeRect(QIODevice *socket, const QImage &screenImage, const QRect &rect) = 0;
 
 protected:
+    // Returns the screen image to encode from, clipping rgn to it and
+    // applying the QNOVNC_VISUALIZE_UPDATE overlay when enabled.
+    QImage updateImage(QRegion *rgn) const;
+    // Returns rect's pixels in the client's pixel format. With a stride the
+    // result may point straight into screenImage or the frame cache, without
+    // one the rows are always packed (into buffer if needed).
+    const uchar *clientPixels(const QImage &screenImage, const QRect &rect,
+                              QByteArray *buffer, qsizetype *stride = nullptr) const;
+
+    // Takes the tiles of rgn that repeat an earlier tile of the update out
+    // of it, to be sent as CopyRects by writeTileCopies() after the rects.
+    void findDuplicateTiles(const QImage &screenImage, QRegion *rgn);
+    void writeTileCopies(QIODevice *socket);
+
+    // Also writes the client's pending CopyRects, and counts the tile
+    // copies; both come on top of rectCount
+    void writeUpdateHeader(QIODevice *socket, int rectCount) const;
+    static void writeRectHeader(QIODevice *socket, const QRect &rect, qint32 encoding);
+    void writeRawRect(QIODevice *socket, const QRect &rect,
+                      const uchar *pixels, qsizetype stride) const;
+    // Mask selecting the colour bits of a client pixel read straight from
+    // memory, so that padding bits never make equal colours differ.
+    quint32 clientPixelMask() const;
+
     QNoVncClient *client;
+    QVector<QRect> m_rects;
+
+private:
+    struct TileCopy {
+        QRect rect;
+        QPoint source;
+    };
+    QVector<TileCopy> m_tileCopies;
 };
 
+// Registry entry describing how to create the encoder of one RFB encoding
+class QRfbEncoderFactory
+{
+public:
+    enum Capability {
+        // Writes any rect on its own, so it can share an update with others
+        PerRect = 0x1,
+        // Built for the client's bytes per pixel at the time of creation
+        PixelSizeSpecific = 0x2
+    };
+
+    static const QRfbEncoderFactory *find(qint32 encoding);
+    static const QRfbEncoderFactory *find(const QByteArray &name);
+
+    qint32 encoding;
+    const char *name;
+    uint capabilities;
+    // Set to 1 in the environment, the encoding wins over the client's order
+    const char *preferVariable;
+    QRfbEncoder *(*create)(QNoVncClient *client);
+};
+
+// One persistent deflate stream, flushed with Z_SYNC_FLUSH after every
+// rectangle as required by the zlib based RFB encodings.
+class QRfbZlibStream
+{
+public:
+    QRfbZlibStream();
+    ~QRfbZlibStream();
+
+    bool compress(const char *data, qsizetype size, qsizetype *compressedSize);
+    const char *compressedData() const { return m_compressBuffer.constData(); }
+    bool isInitialized() const { return m_streamInitialized; }
+    // Takes effect with the next compress() call, without resetting the stream.
+    void setLevel(int level) { m_level = qBound(0, level, 9); }
+
+private:
+    Q_DISABLE_COPY(QRfbZlibStream)
+
+    QByteArray m_compressBuffer;
+    z_stream m_stream;
+    bool m_streamInitialized = false;
+    int m_level = 2;
+    int m_streamLevel = 2;
+};
+
+// Collects the distinct colours of a pixel block, giving up once more than
+// maxColors have been seen.
+class QRfbPalette
+{
+public:
+    enum { MaxColors = 256 };
+
+    QRfbPalette() { memset(m_slotIndex, 0xff, sizeof(m_slotIndex)); }
+
+    void clear(int maxColors);
+    inline bool insert(quint32 color);
+    inline int indexOf(quint32 color) const;
+
+    int size() const { return m_size; }
+    bool overflowed() const { return m_overflow; }
+    quint32 color(int index) const { return m_colors[index]; }
+
+private:
+    enum { SlotBits = 10, SlotCount = 1 << SlotBits };
+
+    static inline uint slotFor(quint32 color) { return (color * 2654435761u) >> (32 - SlotBits); }
+
+    quint32 m_colors[MaxColors];
+    quint16 m_slots[MaxColors];
+    qint16 m_slotIndex[SlotCount];
+    quint32 m_slotColor[SlotCount];
+    int m_size = 0;
+    int m_maxColors = MaxColors;
+    bool m_overflow = false;
+};
+
+inline bool QRfbPalette::insert(quint32 color)
+{
+    if (m_overflow)
+        return false;
+    uint slot = slotFor(color);
+    while (m_slotIndex[slot] >= 0) {
+        if (m_slotColor[slot] == color)
+            return true;
+        slot = (slot + 1) & (SlotCount - 1);
+    }
+    if (m_size == m_maxColors) {
+        m_overflow = true;
+        return false;
+    }
+    m_slotIndex[slot] = qint16(m_size);
+    m_slotColor[slot] = color;
+    m_slots[m_size] = quint16(slot);
+    m_colors[m_size++] = color;
+    return true;
+}
+
+inline int QRfbPalette::indexOf(quint32 color) const
+{
+    uint slot = slotFor(color);
+    while (m_slotIndex[slot] >= 0) {
+        if (m_slotColor[slot] == color)
+            return m_slotIndex[slot];
+        slot = (slot + 1) & (SlotCount - 1);
+    }
+    return -1;
+}
+
 class QRfbRawEncoder : public QRfbEncoder
 {
 public:
     QRfbRawEncoder(QNoVncClient *s) : QRfbEncoder(s) {}
 
-    void write() override;
+    void writeRect(QIODevice *socket, const QImage &screenImage, const QRect &rect) override;
 
 private:
     QByteArray buffer;
@@ -207,23 +413,169 @@ private:
 class QRfbZlibEncoder : public QRfbEncoder
 {
 public:
-    QRfbZlibEncoder(QNoVncClient *s);
-    ~QRfbZlibEncoder() override;
+    QRfbZlibEncoder(QNoVncClient *s) : QRfbEncoder(s) {}
 
-    void write() override;
+    void beginUpdate() override;
+    void writeRect(QIODevice *socket, const QImage &screenImage, const QRect &rect) override;
+
+private:
+    QByteArray m_pixelBuffer;
+    QRfbZlibStream m_stream;
+};
+
+class QRfbZrleEncoder : public QRfbEncoder
+{
+public:
+    QRfbZrleEncoder(QNoVncClient *s) : QRfbEncoder(s) {}
+
+    void beginUpdate() override;
+    void writeRect(QIODevice *socket, const QImage &screenImage, const QRect &rect) override;
 
 private:
-    bool compressCurrentBuffer(qsizetype rawSize, qsizetype *compressedSize);
-    void ensurePixelBuffer(qsizetype size);
-    void ensureCompressedBuffer(qsizetype minimumSize);
+    enum { TileSize = 64 };
+
+    bool setupCPixel();
+    template <class T>
+    uchar *encodeRect(uchar *out, const uchar *pixels, qsizetype stride, int width, int height);
+    template <class T>
+    uchar *encodeTile(uchar *out, const uchar *pixels, qsizetype stride, int width, int height);
+    template <class T>
+    inline uchar *writeCPixel(uchar *out, T pixel) const;
 
     QByteArray m_pixelBuffer;
-    QByteArray m_compressBuffer;
-    z_stream m_stream;
-    bool m_streamInitialized = false;
+    QByteArray m_tileBuffer;
+    QRfbZlibStream m_stream;
+    QRfbPalette m_palette;
+    quint32 m_pixelMask = 0;
+    int m_cpixelSize = 0;
+    int m_cpixelOffset = 0;
+    bool m_cpixelValid = false;
+};
+
+class QRfbTightEncoder : public QRfbEncoder
+{
+public:
+    QRfbTightEncoder(QNoVncClient *s) : QRfbEncoder(s), m_encoding(TightEncoding) {}
+
+    void beginUpdate() override;
+    void splitRect(const QRect &rect, QVector<QRect> *rects) const override;
+    void writeRect(QIODevice *socket, const QImage &screenImage, const QRect &rect) override;
+
+protected:
+    enum Encoding {
+        TightEncoding = 7,
+        TightPngEncoding = -260
+    };
+    QRfbTightEncoder(QNoVncClient *s, Encoding encoding) : QRfbEncoder(s), m_encoding(encoding) {}
+
+    enum {
+        MaxRectWidth = 2048,
+        MaxRectPixels = 65536,
+        MinCompressSize = 12
+    };
+    enum CompressionControl {
+        FillCompression = 0x80,
+        JpegCompression = 0x90,
+        PngCompression = 0xA0,
+        ExplicitFilter = 0x40
+    };
+    enum Filter {
+        CopyFilter = 0,
+        PaletteFilter = 1
+    };
+    enum Stream {
+        FullColorStream = 0,
+        MonoStream = 1,
+        IndexedStream = 2
+    };
+    enum RectType {
+        SolidRect,
+        MonoRect,
+        IndexedRect,
+        FullColorRect
+    };
+
+    void setupTPixel();
+    template <class T>
+    RectType classify(const uchar *pixels, qsizetype stride, int width, int height);
+    template <class T>
+    bool isSmooth(const uchar *pixels, qsizetype stride, int width, int height) const;
+    template <class T>
+    inline void colorComponents(T pixel, int *rgb) const;
+    template <class T>
+    inline uchar *writeTPixel(uchar *out, T pixel) const;
+    template <class T>
+    void writeIndices(uchar *out, qsizetype outStride, const uchar *pixels, qsizetype stride,
+                      int width, int height) const;
+    template <class T>
+    bool writeTightRect(QIODevice *socket, const QImage &screenImage, const QRect &rect,
+                        const uchar *pixels, qsizetype stride);
+    template <class T>
+    bool writePng(QIODevice *socket, const QImage &screenImage, const QRect &rect,
+                  RectType type, const uchar *pixels, qsizetype stride);
+    bool writeBasic(QIODevice *socket, const QRect &rect, int stream,
+                    QByteArray *header, qsizetype dataSize);
+    bool writeJpeg(QIODevice *socket, const QImage &screenImage, const QRect &rect);
+    static void appendCompactLength(QByteArray *out, qsizetype length);
+
+    QByteArray m_pixelBuffer;
+    QByteArray m_dataBuffer;
+    QByteArray m_jpegBuffer;
+    QByteArray m_pngBuffer;
+    QByteArray m_header;
+    QRfbZlibStream m_streams[4];
+    QRfbPalette m_palette;
+    quint32 m_pixelMask = 0;
+    int m_tpixelSize = 0;
+    int m_jpegQuality = -1;
+    bool m_tpixel24 = false;
+    bool m_swapPixel = false;
+    const qint32 m_encoding;
+};
+
+// TightPNG sends everything but fills and JPEG as PNG, so browsers decode
+// rectangles with their native image decoders instead of inflating in script.
+class QRfbTightPngEncoder : public QRfbTightEncoder
+{
+public:
+    QRfbTightPngEncoder(QNoVncClient *s) : QRfbTightEncoder(s, TightPngEncoding) {}
+};
+
+class QRfbRreEncoder : public QRfbEncoder
+{
+public:
+    QRfbRreEncoder(QNoVncClient *s) : QRfbEncoder(s), m_encoding(RreEncoding) {}
+
+    void beginUpdate() override;
+    void splitRect(const QRect &rect, QVector<QRect> *rects) const override;
+    void writeRect(QIODevice *socket, const QImage &screenImage, const QRect &rect) override;
+
+protected:
+    enum Encoding {
+        RreEncoding = 2,
+        CoRreEncoding = 4
+    };
+    QRfbRreEncoder(QNoVncClient *s, Encoding encoding) : QRfbEncoder(s), m_encoding(encoding) {}
+
+    enum { MaxCoRreSize = 255 };
+
+    template <class T>
+    bool writeRreRect(QIODevice *socket, const QRect &rect, const uchar *pixels, qsizetype stride);
+
+    QByteArray m_pixelBuffer;
+    QByteArray m_workBuffer;
+    QByteArray m_dataBuffer;
+    quint32 m_pixelMask = 0;
+    const qint32 m_encoding;
+};
+
+// CoRRE limits rects to 255x255 so subrect geometry fits in single bytes.
+class QRfbCoRreEncoder : public QRfbRreEncoder
+{
+public:
+    QRfbCoRreEncoder(QNoVncClient *s) : QRfbRreEncoder(s, CoRreEncoding) {}
 };
 
-/*
 template <class SRC> class QRfbHextileEncoder;
 
 template <class SRC>
@@ -232,7 +584,7 @@ class QRfbSingleColorHextile
 public:
     QRfbSingleColorHextile(QRfbHextileEncoder<SRC> *e) : encoder(e) {}
     bool read(const uchar *data, int width, int height, int stride);
-    void write(QIODevice *socket) const;
+    void write(QByteArray *out) const;
 
 private:
     QRfbHextileEncoder<SRC> *encoder;
@@ -244,7 +596,7 @@ class QRfbDualColorHextile
 public:
     QRfbDualColorHextile(QRfbHextileEncoder<SRC> *e) : encoder(e) {}
     bool read(const uchar *data, int width, int height, int stride);
-    void write(QIODevice *socket) const;
+    void write(QByteArray *out) const;
 
 private:
     struct Rect {
@@ -289,7 +641,7 @@ class QRfbMultiColorHextile
 public:
     QRfbMultiColorHextile(QRfbHextileEncoder<SRC> *e) : encoder(e) {}
     bool read(const uchar *data, int width, int height, int stride);
-    void write(QIODevice *socket) const;
+    void write(QByteArray *out) const;
 
 private:
     inline quint8* rect(int r) {
@@ -332,15 +684,20 @@ private:
 
     quint8 bpp;
     quint8 numRects;
+    int maxRects;
     QRfbHextileEncoder<SRC> *encoder;
 };
 
+// SRC is the client pixel type, the tiles are read from pixels that were
+// already converted to the client format.
 template <class SRC>
 class QRfbHextileEncoder : public QRfbEncoder
 {
 public:
-    QRfbHextileEncoder(QNoVncServer *s);
-    void write();
+    QRfbHextileEncoder(QNoVncClient *s);
+
+    void beginUpdate() override;
+    void writeRect(QIODevice *socket, const QImage &screenImage, const QRect &rect) override;
 
 private:
     enum SubEncoding {
@@ -351,20 +708,80 @@ private:
         SubrectsColoured = 16
     };
 
+    void writeRawTile(QByteArray *out, const uchar *data, int width, int height, int stride);
+
     QByteArray buffer;
+    QByteArray tileData;
     QRfbSingleColorHextile<SRC> singleColorHextile;
     QRfbDualColorHextile<SRC> dualColorHextile;
     QRfbMultiColorHextile<SRC> multiColorHextile;
 
+    SRC pixelMask;
     SRC bg;
     SRC fg;
     bool newBg;
     bool newFg;
+    // bg and fg are only known to the client after they were sent in the
+    // current rectangle, and a raw tile leaves them undefined again.
+    bool validBg;
+    bool validFg;
+    // The client may have switched pixel formats since it chose hextile
+    bool formatMatches;
 
     friend class QRfbSingleColorHextile<SRC>;
     friend class QRfbDualColorHextile<SRC>;
     friend class QRfbMultiColorHextile<SRC>;
-};*/
+};
+
+// Picks the encoding of every dirty rect from the ones the client supports,
+// judging the rect by its size and by the colours of a pixel sample.
+class QRfbAdaptiveEncoder : public QRfbEncoder
+{
+public:
+    enum Encoding {
+        RawEncoding = 0,
+        RreEncoding = 2,
+        CoRreEncoding = 4,
+        HextileEncoding = 5,
+        ZlibEncoding = 6,
+        TightEncoding = 7,
+        ZrleEncoding = 16,
+        TightPngEncoding = -260
+    };
+
+    QRfbAdaptiveEncoder(QNoVncClient *s);
+
+    // Chooses the encoder of each rect class from the client's encodings
+    void setEncodings(const QVector<qint32> &encodings);
+
+    void write() override;
+    void beginUpdate() override;
+    void writeRect(QIODevice *socket, const QImage &screenImage, const QRect &rect) override;
+
+private:
+    enum RectClass {
+        TinyRect,
+        SolidRect,
+        FlatRect,
+        DetailedRect,
+        PhotoRect,
+        RectClassCount
+    };
+    enum {
+        MaxRawBytes = 64,
+        MaxFlatColors = 16,
+        SamplePixels = 1024
+    };
+
+    RectClass classify(const QImage &screenImage, const QRect &rect);
+    template <class T>
+    void samplePixels(const QImage &screenImage, const QRect &rect, int step);
+
+    QRfbEncoder *m_classEncoders[RectClassCount];
+    // The encoder of each entry in m_rects
+    QVector<QRfbEncoder *> m_rectEncoders;
+    QRfbPalette m_palette;
+};
 
 #if QT_CONFIG(cursor)
 class QNoVncClientCursor : public QPlatformCursor
@@ -397,6 +814,9 @@ public:
                      SetColourMapEntries = 1 };
 
     void setDirty();
+    // With QNOVNC_MATCH_CLIENT_FORMAT=1, switches a 32 bpp screen image to
+    // the layout most connected clients ask for, so that they get it as is
+    void updateScreenFormat();
 
 
     inline QNoVncScreen* screen() const { return QNoVnc_screen; }
@@ -0,0 +1,36 @@
+#include "qnovncbackingstore.h"
+#include "qnovncwindow.h"
+#include "qnovncscreen.h"
+
+#include <QtGui/QScreen>
+
+QNoVncBackingStore::QNoVncBackingStore(QWindow *window)
+    : QFbBackingStore(window)
+{
+
+}
+
+void QNoVncBackingStore::flush(QWindow *window, const QRegion &region, const QPoint &offset)
+{
+    Q_UNUSED(offset);
+
+    static_cast<QNoVncWindow *>(window->handle())->flush(region);
+}
+
+void QNoVncBackingStore::resize(const QSize &size, const QRegion &staticContents)
+{
+    Q_UNUSED(staticContents);
+
+    const QImage::Format format =
+            static_cast<QNoVncScreen *>(window()->screen()->handle())->image()->format();
+    if (mImage.size() != size || mImage.format() != format)
+        mImage = QImage(size, format);
+}
+
+void QNoVncBackingStore::setFormat(QImage::Format format)
+{
+    lock();
+    if (!mImage.isNull() && mImage.format() != format)
+        mImage = mImage.convertToFormat(format);
+    unlock();
+}
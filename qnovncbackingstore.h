@@ -0,0 +1,22 @@
+#ifndef QNOVNC_QNOVNCBACKINGSTORE_H
+#define QNOVNC_QNOVNCBACKINGSTORE_H
+#include <private/qfbbackingstore_p.h>
+
+
+// Hands the exact flushed region to the window, where QFbBackingStore
+// would repaint its bounding rect
+class QNoVncBackingStore : public QFbBackingStore
+{
+public:
+    QNoVncBackingStore(QWindow *window);
+
+    void flush(QWindow *window, const QRegion &region, const QPoint &offset) override;
+    // Allocates the image in the screen image's exact format, so that the
+    // screen composes it by copying rows
+    void resize(const QSize &size, const QRegion &staticContents) override;
+    // Converts the image when the screen changes format
+    void setFormat(QImage::Format format);
+};
+
+
+#endif //QNOVNC_QNOVNCBACKINGSTORE_H
\ No newline at end of file
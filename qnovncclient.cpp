@@ -9,6 +9,7 @@
 #include <qpa/qwindowsysteminterface.h>
 #include <QtGui/qguiapplication.h>
 #include <QtCore/QElapsedTimer>
+#include <algorithm>
 #include <atomic>
 
 #ifdef Q_OS_WIN
@@ -30,11 +31,18 @@ QNoVncClient::QNoVncClient(QWebSocket *clientSocket, QNoVncServer *server)
     , m_encoder(nullptr)
     , m_msgType(0)
     , m_handleMsg(false)
-    , m_sameEndian(true)
     , m_needConversion(true)
     , m_encodingsPending(0)
     , m_cutTextPending(0)
+    , m_qualityLevel(-1)
+    , m_compressionLevel(DefaultCompressionLevel)
+    , m_supportCopyRect(false)
+    , m_supportRRE(false)
+    , m_supportCoRRE(false)
     , m_supportHextile(false)
+    , m_supportZRLE(false)
+    , m_supportCursor(false)
+    , m_supportDesktopSize(false)
     , m_wantUpdate(false)
     , m_dirtyCursor(false)
     , m_updatePending(false)
@@ -43,10 +51,17 @@ QNoVncClient::QNoVncClient(QWebSocket *clientSocket, QNoVncServer *server)
 #endif
     , m_protocolVersion(V3_3)
     , m_clientId(++s_nextClientId)
+    , m_refineTimer(new QTimer(this))
 {
     connect(m_clientSocket,SIGNAL(readyRead()),this,SLOT(readClient()));
     connect(m_clientSocket->socket(),SIGNAL(disconnected()),this,SLOT(discardClient()));
 
+    m_refineTimer->setSingleShot(true);
+    connect(m_refineTimer,SIGNAL(timeout()),this,SLOT(scheduleUpdate()));
+    if (qEnvironmentVariableIsSet("QNOVNC_REFINE_DELAY_MS"))
+        m_refineDelayMs = qEnvironmentVariableIntValue("QNOVNC_REFINE_DELAY_MS");
+    m_lossyClock.start();
+
     m_debugTimingEnabled = qEnvironmentVariableIntValue("QNOVNC_DEBUG_REFRESH") == 1;
     const int requestedWindow = qEnvironmentVariableIntValue("QNOVNC_DEBUG_REFRESH_WINDOW_MS");
     if (requestedWindow > 0)
@@ -60,7 +75,8 @@ QNoVncClient::QNoVncClient(QWebSocket *clientSocket, QNoVncServer *server)
 
 QNoVncClient::~QNoVncClient()
 {
-    delete m_encoder;
+    delete m_adaptiveEncoder;
+    qDeleteAll(m_encoders);
 }
 
 QWebSocketDevice* QNoVncClient::clientSocket() const
@@ -72,136 +88,175 @@ void QNoVncClient::setDirty(const QRegion &region)
 {
     m_dirtyRegion += region;
     if (m_state == Connected &&
-        ((m_server->dirtyMap()->numDirty > 0) || m_dirtyCursor)) {
+        ((m_server->dirtyMap()->numDirty > 0) || m_dirtyCursor || !m_copiedRegion.isEmpty())) {
         scheduleUpdate();
     }
 }
 
-void QNoVncClient::convertPixels(char *dst, const char *src, int count, int screendepth) const
+void QNoVncClient::setCopied(const QRegion &region, const QPoint &delta)
 {
-    // cutoffs
-#if Q_BYTE_ORDER == Q_BIG_ENDIAN
-    if (!m_swapBytes)
-#endif
-    if (m_sameEndian) {
-        if (screendepth == m_pixelFormat.bitsPerPixel) { // memcpy cutoffs
-
-            switch (screendepth) {
-            case 32:
-                memcpy(dst, src, count * sizeof(quint32));
-                return;
-            case 16:
-                if (m_pixelFormat.redBits == 5
-                    && m_pixelFormat.greenBits == 6
-                    && m_pixelFormat.blueBits == 5)
-                {
-                    memcpy(dst, src, count * sizeof(quint16));
-                    return;
-                }
-            }
+    if (!m_supportCopyRect) {
+        m_dirtyRegion += region;
+        return;
+    }
+
+    // Pixels the client has not been sent yet cannot be copied; they stay
+    // dirty at their new place.
+    QRegion source = region.translated(-delta);
+    if (m_copiedRegion.isEmpty() || !source.intersects(m_copiedRegion)) {
+        // Only one move can be pending, keep the larger one
+        if (!m_copiedRegion.isEmpty()
+            && m_copiedRegion.boundingRect().width() * m_copiedRegion.boundingRect().height()
+               > region.boundingRect().width() * region.boundingRect().height()) {
+            m_dirtyRegion += region;
+            return;
         }
+        m_dirtyRegion += (source & m_dirtyRegion).translated(delta);
+        m_dirtyRegion += m_copiedRegion;
+        m_copiedRegion = region;
+        m_copyDelta = delta;
+        return;
     }
 
-    const int bytesPerPixel = (m_pixelFormat.bitsPerPixel + 7) / 8;
+    // Copying what a pending copy put there continues that copy
+    const QRegion overlap = source & m_copiedRegion;
+    m_dirtyRegion += (overlap & m_dirtyRegion).translated(delta);
+    const QRegion continued = overlap.translated(delta);
+    m_dirtyRegion += (region | m_copiedRegion) - continued;
+    m_copiedRegion = continued;
+    m_copyDelta += delta;
+}
 
-    for (int i = 0; i < count; ++i) {
-        int r, g, b;
+QVector<QRect> QNoVncClient::copyRects() const
+{
+    QRegion region = m_copiedRegion - m_dirtyRegion;
+    region &= QRect(QPoint(0, 0), m_server->screen()->geometry().size());
+    QVector<QRect> rects(region.begin(), region.end());
+
+    // Copy the rects furthest along the move first
+    const QPoint delta = m_copyDelta;
+    std::sort(rects.begin(), rects.end(), [delta](const QRect &a, const QRect &b) {
+        if (a.y() != b.y())
+            return delta.y() > 0 ? a.y() > b.y() : a.y() < b.y();
+        return delta.x() > 0 ? a.x() > b.x() : a.x() < b.x();
+    });
+    return rects;
+}
 
-        switch (screendepth) {
-        case 8: {
-            QRgb rgb = m_server->screen()->image()->colorTable()[int(*src)];
-            r = qRed(rgb);
-            g = qGreen(rgb);
-            b = qBlue(rgb);
-            src++;
-            break;
-        }
-        case 16: {
-            quint16 p = *reinterpret_cast<const quint16*>(src);
-#if Q_BYTE_ORDER == Q_BIG_ENDIAN
-            if (m_swapBytes)
-                p = ((p & 0xff) << 8) | ((p & 0xff00) >> 8);
-#endif
-            r = (p >> 11) & 0x1f;
-            g = (p >> 5) & 0x3f;
-            b = p & 0x1f;
-            r <<= 3;
-            g <<= 2;
-            b <<= 3;
-            src += sizeof(quint16);
-            break;
-        }
-        case 32: {
-            quint32 p = *reinterpret_cast<const quint32*>(src);
-            r = (p >> 16) & 0xff;
-            g = (p >> 8) & 0xff;
-            b = p & 0xff;
-            src += sizeof(quint32);
-            break;
-        }
-        default: {
-            r = g = b = 0;
-            qWarning("QVNCServer: don't support %dbpp display", screendepth);
-            return;
-        }
-        }
+bool QNoVncClient::isLossy(const QRect &rect) const
+{
+    if (m_lossyTileCount == 0)
+        return false;
 
-#if Q_BYTE_ORDER == Q_BIG_ENDIAN
-        if (m_swapBytes)
-            qSwap(r, b);
-#endif
+    const QNoVncDirtyMap *map = m_server->dirtyMap();
+    const int x0 = qMax(0, rect.left() / MAP_TILE_SIZE);
+    const int y0 = qMax(0, rect.top() / MAP_TILE_SIZE);
+    const int x1 = qMin(map->mapWidth - 1, rect.right() / MAP_TILE_SIZE);
+    const int y1 = qMin(map->mapHeight - 1, rect.bottom() / MAP_TILE_SIZE);
+    for (int y = y0; y <= y1; ++y) {
+        const qint64 *tile = m_lossyTiles.constData() + y * map->mapWidth + x0;
+        for (int x = x0; x <= x1; ++x, ++tile) {
+            if (*tile >= 0)
+                return true;
+        }
+    }
+    return false;
+}
 
-        r >>= (8 - m_pixelFormat.redBits);
-        g >>= (8 - m_pixelFormat.greenBits);
-        b >>= (8 - m_pixelFormat.blueBits);
+void QNoVncClient::markLossy(const QRect &rect)
+{
+    if (m_refineDelayMs <= 0)
+        return;
 
-        int pixel = (r << m_pixelFormat.redShift) |
-                    (g << m_pixelFormat.greenShift) |
-                    (b << m_pixelFormat.blueShift);
+    const QNoVncDirtyMap *map = m_server->dirtyMap();
+    if (m_lossyTiles.size() != map->mapWidth * map->mapHeight) {
+        m_lossyTiles.fill(-1, map->mapWidth * map->mapHeight);
+        m_lossyTileCount = 0;
+    }
 
-        if (m_sameEndian || m_pixelFormat.bitsPerPixel == 8) {
-            memcpy(dst, &pixel, bytesPerPixel);
-            dst += bytesPerPixel;
-            continue;
+    // Tiles only partly covered are refined as a whole, which is harmless
+    const int x0 = qMax(0, rect.left() / MAP_TILE_SIZE);
+    const int y0 = qMax(0, rect.top() / MAP_TILE_SIZE);
+    const int x1 = qMin(map->mapWidth - 1, rect.right() / MAP_TILE_SIZE);
+    const int y1 = qMin(map->mapHeight - 1, rect.bottom() / MAP_TILE_SIZE);
+    const qint64 now = m_lossyClock.elapsed();
+    for (int y = y0; y <= y1; ++y) {
+        qint64 *tile = m_lossyTiles.data() + y * map->mapWidth + x0;
+        for (int x = x0; x <= x1; ++x, ++tile) {
+            if (*tile < 0)
+                ++m_lossyTileCount;
+            *tile = now;
         }
+    }
 
+    if (!m_refineTimer->isActive())
+        m_refineTimer->start(m_refineDelayMs);
+}
 
-        if (QSysInfo::ByteOrder == QSysInfo::BigEndian) {
-            switch (m_pixelFormat.bitsPerPixel) {
-            case 16:
-                pixel = (((pixel & 0x0000ff00) << 8)  |
-                         ((pixel & 0x000000ff) << 24));
-                break;
-            case 32:
-                pixel = (((pixel & 0xff000000) >> 24) |
-                         ((pixel & 0x00ff0000) >> 8)  |
-                         ((pixel & 0x0000ff00) << 8)  |
-                         ((pixel & 0x000000ff) << 24));
-                break;
-            default:
-                qWarning("Cannot handle %d bpp client", m_pixelFormat.bitsPerPixel);
+void QNoVncClient::clearLossy(const QRegion &region)
+{
+    if (!m_lossyTileCount)
+        return;
+
+    // Only tiles resent completely lose their lossy state
+    const int mapWidth = m_server->dirtyMap()->mapWidth;
+    const int mapHeight = m_server->dirtyMap()->mapHeight;
+    for (const QRect &rect : region) {
+        const int x0 = qMax(0, (rect.left() + MAP_TILE_SIZE - 1) / MAP_TILE_SIZE);
+        const int y0 = qMax(0, (rect.top() + MAP_TILE_SIZE - 1) / MAP_TILE_SIZE);
+        const int x1 = qMin(mapWidth, (rect.right() + 1) / MAP_TILE_SIZE);
+        const int y1 = qMin(mapHeight, (rect.bottom() + 1) / MAP_TILE_SIZE);
+        for (int y = y0; y < y1; ++y) {
+            qint64 *tile = m_lossyTiles.data() + y * mapWidth + x0;
+            for (int x = x0; x < x1; ++x, ++tile) {
+                if (*tile >= 0) {
+                    *tile = -1;
+                    --m_lossyTileCount;
+                }
             }
-        } else { // QSysInfo::ByteOrder == QSysInfo::LittleEndian
-            switch (m_pixelFormat.bitsPerPixel) {
-            case 16:
-                pixel = (((pixel & 0xff000000) >> 8) |
-                         ((pixel & 0x00ff0000) << 8));
-                break;
-            case 32:
-                pixel = (((pixel & 0xff000000) >> 24) |
-                         ((pixel & 0x00ff0000) >> 8)  |
-                         ((pixel & 0x0000ff00) << 8)  |
-                         ((pixel & 0x000000ff) << 24));
-                break;
-            default:
-                qWarning("Cannot handle %d bpp client",
-                       m_pixelFormat.bitsPerPixel);
-                break;
+        }
+    }
+}
+
+bool QNoVncClient::refineLossyTiles()
+{
+    const int mapWidth = m_server->dirtyMap()->mapWidth;
+    const int mapHeight = m_server->dirtyMap()->mapHeight;
+    const qint64 now = m_lossyClock.elapsed();
+    qint64 nextRefine = -1;
+    QRegion quiet;
+
+    for (int y = 0; y < mapHeight; ++y) {
+        const qint64 *row = m_lossyTiles.constData() + y * mapWidth;
+        int runStart = -1;
+        for (int x = 0; x <= mapWidth; ++x) {
+            const qint64 sent = x < mapWidth ? row[x] : -1;
+            const bool isQuiet = sent >= 0 && now - sent >= m_refineDelayMs;
+            if (sent >= 0 && !isQuiet) {
+                const qint64 due = sent + m_refineDelayMs;
+                nextRefine = nextRefine < 0 ? due : qMin(nextRefine, due);
+            }
+            if (isQuiet && runStart < 0) {
+                runStart = x;
+            } else if (!isQuiet && runStart >= 0) {
+                quiet += QRect(runStart * MAP_TILE_SIZE, y * MAP_TILE_SIZE,
+                               (x - runStart) * MAP_TILE_SIZE, MAP_TILE_SIZE);
+                runStart = -1;
             }
         }
-        memcpy(dst, &pixel, bytesPerPixel);
-        dst += bytesPerPixel;
     }
+
+    if (nextRefine >= 0)
+        m_refineTimer->start(int(nextRefine - now));
+    if (quiet.isEmpty() || !m_encoder)
+        return false;
+
+    clearLossy(quiet);
+    m_dirtyRegion = quiet;
+    m_refining = true;
+    m_encoder->write();
+    m_refining = false;
+    return true;
 }
 
 void QNoVncClient::readClient()
@@ -246,16 +301,8 @@ void QNoVncClient::readClient()
                 QRfbPixelFormat &format = sim.format;
                 switch (m_server->screen()->depth()) {
                 case 32:
-                    format.bitsPerPixel = 32;
-                    format.depth = 32;
-                    format.bigEndian = 0;
-                    format.trueColor = true;
-                    format.redBits = 8;
-                    format.greenBits = 8;
-                    format.blueBits = 8;
-                    format.redShift = 16;
-                    format.greenShift = 8;
-                    format.blueShift = 0;
+                    // The screen image's own layout, which needs no conversion
+                    format = QNoVncPixelConverter::screenFormat(m_server->screen()->image()->format());
                     break;
 
                 case 24:
@@ -347,11 +394,7 @@ void QNoVncClient::readClient()
                 sim.setName("Qt for Embedded Linux VNC Server");
                 sim.write(m_clientSocket);
                 m_pixelFormat = format;
-                m_sameEndian = (QSysInfo::ByteOrder == QSysInfo::BigEndian) == !!m_pixelFormat.bigEndian;
-                m_needConversion = pixelConversionNeeded();
-#if Q_BYTE_ORDER == Q_BIG_ENDIAN
-                m_swapBytes = m_server->screen()->swapBytes();
-#endif
+                updatePixelConversion();
                 m_state = Connected;
             }
             break;
@@ -416,11 +459,12 @@ void QNoVncClient::checkUpdate()
         return;
     }
 #endif
-    if (!m_dirtyRegion.isEmpty()) {
+    if (!m_dirtyRegion.isEmpty() || !m_copiedRegion.isEmpty()) {
         qint64 encodeDurationNs = 0;
         QElapsedTimer encodeTimer;
         if (m_debugTimingEnabled)
             encodeTimer.start();
+        clearLossy(m_dirtyRegion);
         if (m_encoder)
             m_encoder->write();
         if (m_debugTimingEnabled)
@@ -428,6 +472,11 @@ void QNoVncClient::checkUpdate()
         recordClientStats(encodeDurationNs);
         m_wantUpdate = false;
         m_dirtyRegion = QRegion();
+        m_copiedRegion = QRegion();
+    } else if (m_lossyTileCount && refineLossyTiles()) {
+        // Nothing changed since the client asked, so the link is idle
+        m_wantUpdate = false;
+        m_dirtyRegion = QRegion();
     }
 }
 
@@ -496,7 +545,9 @@ void QNoVncClient::recordClientStats(qint64 encodeDurationNs)
         << ", last interval " << QString::number(lastIntervalMs, 'f', 2) << " ms"
         << ", avg encode " << QString::number(avgEncodeMs, 'f', 2) << " ms"
         << ", last encode " << QString::number(lastEncodeMs, 'f', 2) << " ms"
-        << ", frames=" << m_updateFrames;
+        << ", frames=" << m_updateFrames
+        << ", converted blits " << m_server->screen()->convertedBlits
+        << "/" << (m_server->screen()->convertedBlits + m_server->screen()->copiedBlits);
 
     m_updateFrames = 0;
     m_updateAccumIntervalNs = 0;
@@ -525,12 +576,26 @@ void QNoVncClient::setPixelFormat()
             discardClient();
         }
         m_handleMsg = false;
-        m_sameEndian = (QSysInfo::ByteOrder == QSysInfo::BigEndian) == !!m_pixelFormat.bigEndian;
-        m_needConversion = pixelConversionNeeded();
+        updatePixelConversion();
+        // Encoders for one pixel size, hextile and the ones the adaptive
+        // encoder picked, have to follow a change of pixel size
+        if (m_encoder) {
+            m_encoder = selectEncoder(m_encodings);
+            if (!m_encoder)
+                m_encoder = encoder(0);
+        }
+        m_server->updateScreenFormat();
+    }
+}
+
+void QNoVncClient::updatePixelConversion()
+{
 #if Q_BYTE_ORDER == Q_BIG_ENDIAN
-        m_swapBytes = server()->screen()->swapBytes();
+    m_swapBytes = m_server->screen()->swapBytes();
 #endif
-    }
+    // The kernel is picked here, not per pixel
+    m_converter.setFormat(m_pixelFormat, *m_server->screen()->image());
+    m_needConversion = pixelConversionNeeded();
 }
 
 void QNoVncClient::setEncodings()
@@ -543,60 +608,41 @@ void QNoVncClient::setEncodings()
             m_handleMsg = false;
     }
 
-    if (m_encoder) {
-        delete m_encoder;
-        m_encoder = nullptr;
-    }
-
     enum Encodings {
         Raw = 0,
         CopyRect = 1,
         RRE = 2,
         CoRRE = 4,
         Hextile = 5,
-        Zlib = 6,
         ZRLE = 16,
+        QualityLevel0 = -32,
+        QualityLevel9 = -23,
+        CompressionLevel0 = -256,
+        CompressionLevel9 = -247,
         Cursor = -239,
         DesktopSize = -223
     };
 
     if (m_encodingsPending && (unsigned)m_clientSocket->bytesAvailable() >=
                                 m_encodingsPending * sizeof(quint32)) {
+        m_qualityLevel = -1;
+        m_compressionLevel = DefaultCompressionLevel;
+        const bool hadCopyRect = m_supportCopyRect;
+        const bool hadCursor = m_supportCursor;
+        m_supportCopyRect = false;
+        m_supportCursor = false;
+        m_supportDesktopSize = false;
+        // The rect encodings we implement, in the client's order
+        QVector<qint32> encodings;
         for (int i = 0; i < m_encodingsPending; ++i) {
             qint32 enc;
             m_clientSocket->read((char *)&enc, sizeof(qint32));
             enc = ntohl(enc);
             qCDebug(lcVnc, "QNoVncServer::setEncodings: %d", enc);
             switch (enc) {
-            case Raw:
-                if (!m_encoder) {
-                    m_encoder = new QRfbRawEncoder(this);
-                    qCDebug(lcVnc, "QNoVncServer::setEncodings: using raw");
-                }
-               break;
             case CopyRect:
                 m_supportCopyRect = true;
                 break;
-            case RRE:
-                m_supportRRE = true;
-                break;
-            case CoRRE:
-                m_supportCoRRE = true;
-                break;
-            case Hextile:
-                m_supportHextile = true;
-                if (m_encoder)
-                    break;
-                break;
-            case Zlib:
-                if (!m_encoder) {
-                    m_encoder = new QRfbZlibEncoder(this);
-                    qCDebug(lcVnc, "QNoVncServer::setEncodings: using zlib");
-                }
-                break;
-            case ZRLE:
-                m_supportZRLE = true;
-                break;
             case Cursor:
                 m_supportCursor = true;
                 m_server->screen()->enableClientCursor(this);
@@ -605,19 +651,119 @@ void QNoVncClient::setEncodings()
                 m_supportDesktopSize = true;
                 break;
             default:
+                if (enc >= QualityLevel0 && enc <= QualityLevel9)
+                    m_qualityLevel = enc - QualityLevel0;
+                else if (enc >= CompressionLevel0 && enc <= CompressionLevel9)
+                    m_compressionLevel = enc - CompressionLevel0;
+                else if (QRfbEncoderFactory::find(enc) && !encodings.contains(enc))
+                    encodings.append(enc);
                 break;
             }
         }
+        // A client may drop encodings it listed before: copies it was not
+        // sent yet are sent as pixels, and the screen draws the cursor again
+        if (hadCopyRect && !m_supportCopyRect) {
+            m_dirtyRegion += m_copiedRegion;
+            m_copiedRegion = QRegion();
+        }
+        if (hadCursor && !m_supportCursor) {
+            m_dirtyCursor = false;
+            m_server->screen()->disableClientCursor(this);
+        }
+        m_supportRRE = encodings.contains(RRE);
+        m_supportCoRRE = encodings.contains(CoRRE);
+        m_supportHextile = encodings.contains(Hextile);
+        m_supportZRLE = encodings.contains(ZRLE);
         m_handleMsg = false;
         m_encodingsPending = 0;
+
+        m_encodings = encodings;
+        m_encoder = selectEncoder(encodings);
     }
 
     if (!m_encoder) {
-        m_encoder = new QRfbRawEncoder(this);
+        m_encoder = encoder(Raw);
         qCDebug(lcVnc, "QNoVncServer::setEncodings: fallback using raw");
     }
 }
 
+QRfbEncoder *QNoVncClient::encoder(qint32 encoding)
+{
+    const QRfbEncoderFactory *factory = QRfbEncoderFactory::find(encoding);
+    if (!factory)
+        return nullptr;
+
+    quint64 key = quint32(encoding);
+    if (factory->capabilities & QRfbEncoderFactory::PixelSizeSpecific)
+        key |= quint64(clientBytesPerPixel()) << 32;
+
+    QRfbEncoder *&e = m_encoders[key];
+    if (!e)
+        e = factory->create(this);
+    if (!e)
+        m_encoders.remove(key);
+    return e;
+}
+
+QRfbEncoder *QNoVncClient::selectEncoder(const QVector<qint32> &encodings)
+{
+    const QRfbEncoderFactory *raw = QRfbEncoderFactory::find(0);
+    const QRfbEncoderFactory *primary = nullptr;
+
+    // QNOVNC_ENCODING pins one encoding by name, to compare encoders on equal terms
+    const QByteArray forced = qgetenv("QNOVNC_ENCODING");
+    if (!forced.isEmpty()) {
+        primary = QRfbEncoderFactory::find(forced);
+        if (primary && primary != raw && !encodings.contains(primary->encoding)) {
+            qCDebug(lcVnc) << "QNoVncServer::setEncodings: client does not support" << forced;
+            primary = nullptr;
+        }
+        if (primary) {
+            qCDebug(lcVnc, "QNoVncServer::setEncodings: using %s", primary->name);
+            return encoder(primary->encoding);
+        }
+    }
+
+    // Some encodings are only worth it for certain screens, whatever the
+    // client's order says.
+    for (const qint32 enc : encodings) {
+        const QRfbEncoderFactory *factory = QRfbEncoderFactory::find(enc);
+        if (factory->preferVariable && qEnvironmentVariableIntValue(factory->preferVariable) == 1) {
+            primary = factory;
+            break;
+        }
+    }
+    if (!primary)
+        primary = encodings.isEmpty() ? raw : QRfbEncoderFactory::find(encodings.first());
+
+    // With a choice of encodings pick one per rect rather than the
+    // first one listed; QNOVNC_ADAPTIVE_ENCODING=0 restores the latter.
+    const bool adaptive = !qEnvironmentVariableIsSet("QNOVNC_ADAPTIVE_ENCODING")
+                          || qEnvironmentVariableIntValue("QNOVNC_ADAPTIVE_ENCODING") != 0;
+    if (adaptive && (primary->capabilities & QRfbEncoderFactory::PerRect)) {
+        QVector<qint32> rectEncodings;
+        for (const qint32 enc : encodings) {
+            if (QRfbEncoderFactory::find(enc)->capabilities & QRfbEncoderFactory::PerRect)
+                rectEncodings.append(enc);
+        }
+        // A preferred TightPNG takes the place of Tight
+        if (primary->encoding == QRfbAdaptiveEncoder::TightPngEncoding)
+            rectEncodings.removeAll(QRfbAdaptiveEncoder::TightEncoding);
+        if (rectEncodings.size() > 1) {
+            if (!m_adaptiveEncoder)
+                m_adaptiveEncoder = new QRfbAdaptiveEncoder(this);
+            m_adaptiveEncoder->setEncodings(rectEncodings);
+            qCDebug(lcVnc, "QNoVncServer::setEncodings: using adaptive encoding");
+            return m_adaptiveEncoder;
+        }
+    }
+
+    QRfbEncoder *e = encoder(primary->encoding);
+    if (e)
+        qCDebug(lcVnc, "QNoVncServer::setEncodings: using %s", primary->name);
+    return e;
+}
+
 void QNoVncClient::frameBufferUpdateRequest()
 {
     qCDebug(lcVnc) << "FramebufferUpdateRequest";
@@ -711,28 +857,12 @@ void QNoVncClient::clientCutText()
 
 bool QNoVncClient::pixelConversionNeeded() const
 {
-    if (!m_sameEndian)
-        return true;
-
 #if Q_BYTE_ORDER == Q_BIG_ENDIAN
     if (server()->screen()->swapBytes())
         return true;
 #endif
 
-    const int screendepth = m_server->screen()->depth();
-    if (screendepth != m_pixelFormat.bitsPerPixel)
-        return true;
-
-    switch (screendepth) {
-    case 32:
-    case 24:
-        return false;
-    case 16:
-        return (m_pixelFormat.redBits == 5
-                && m_pixelFormat.greenBits == 6
-                && m_pixelFormat.blueBits == 5);
-    }
-    return true;
+    return !m_converter.isIdentity();
 }
 
 QT_END_NAMESPACE
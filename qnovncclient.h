@@ -5,8 +5,10 @@
 #define QVNCCLIENT_H
 
 #include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
 
 #include "qnovnc_p.h"
+#include "qnovncpixelconverter.h"
 #include "qwebsocketdevice.h"
 
 QT_BEGIN_NAMESPACE
@@ -33,6 +35,13 @@ public:
     QNoVncServer *server() const { return m_server; }
 
     void setDirty(const QRegion &region);
+    // Content the client shows moved by delta into region; call before
+    // setDirty() with the rest of the same frame's changes.
+    void setCopied(const QRegion &region, const QPoint &delta);
+    // The pending CopyRects, ordered so that none overwrites a later source
+    QVector<QRect> copyRects() const;
+    QPoint copyDelta() const { return m_copyDelta; }
+    bool supportsCopyRect() const { return m_supportCopyRect; }
     void setDirtyCursor() { m_dirtyCursor = true; scheduleUpdate(); }
     QRegion dirtyRegion() const { return m_dirtyRegion; }
     inline bool isConnected() const { return m_state == Connected; }
@@ -43,9 +52,27 @@ public:
                 : 0;
     }
 
-    void convertPixels(char *dst, const char *src, int count, int depth) const;
+    // Converts a row of screen pixels to the client format
+    void convertPixels(char *dst, const char *src, int count) const { m_converter.convert(dst, src, count); }
     inline bool doPixelConversion() const { return m_needConversion; }
     const QRfbPixelFormat& pixelFormat() const { return m_pixelFormat; }
+    const QNoVncPixelConverter &pixelConverter() const { return m_converter; }
+    // Picks the conversion again, after the client or the screen format changed
+    void updatePixelConversion();
+    // JPEG quality level 0-9 requested by the client, or -1 for lossless only
+    int qualityLevel() const { return m_qualityLevel; }
+    // zlib compression level 0-9 requested by the client
+    int compressionLevel() const { return m_compressionLevel; }
+
+    // This client's instance of an encoding's encoder, created on first use
+    // and kept across SetEncodings messages. Null for unknown encodings.
+    QRfbEncoder *encoder(qint32 encoding);
+
+    // Encoders report rects sent lossy; they are resent lossless once quiet
+    void markLossy(const QRect &rect);
+    bool isLossy(const QRect &rect) const;
+    // True while lossy rects are resent, which then must not go lossy again
+    bool isRefining() const { return m_refining; }
 
 signals:
 
@@ -71,6 +98,10 @@ private:
         V3_7,
         V3_8
     };
+    // zlib level used until the client sends a compression level pseudo-encoding
+    enum { DefaultCompressionLevel = 2 };
+    // How long a lossy tile has to stay unchanged before it is refined
+    enum { DefaultRefineDelay = 500 }; // ms
 
     void setPixelFormat();
     void setEncodings();
@@ -79,21 +110,30 @@ private:
     void keyEvent();
     void clientCutText();
     bool pixelConversionNeeded() const;
+    QRfbEncoder *selectEncoder(const QVector<qint32> &encodings);
     void recordClientStats(qint64 encodeDurationNs);
+    void clearLossy(const QRegion &region);
+    bool refineLossyTiles();
 
     QNoVncServer *m_server;
     QWebSocketDevice *m_clientSocket;
     QRfbEncoder *m_encoder;
+    QHash<quint64, QRfbEncoder *> m_encoders;
+    QRfbAdaptiveEncoder *m_adaptiveEncoder = nullptr;
+    // The rect encodings of the last SetEncodings, in the client's order
+    QVector<qint32> m_encodings;
 
     // Client State
     ClientState m_state;
     quint8 m_msgType;
     bool m_handleMsg;
     QRfbPixelFormat m_pixelFormat;
-    bool m_sameEndian;
+    QNoVncPixelConverter m_converter;
     bool m_needConversion;
     int m_encodingsPending;
     int m_cutTextPending;
+    int m_qualityLevel;
+    int m_compressionLevel;
     uint m_supportCopyRect : 1;
     uint m_supportRRE : 1;
     uint m_supportCoRRE : 1;
@@ -109,9 +149,19 @@ private:
     bool m_swapBytes;
 #endif
     QRegion m_dirtyRegion;
+    QRegion m_copiedRegion;
+    QPoint m_copyDelta;
     ProtocolVersion m_protocolVersion;
     const int m_clientId;
 
+    // Time each dirty map tile was last sent lossy, -1 once it is lossless
+    QVector<qint64> m_lossyTiles;
+    int m_lossyTileCount = 0;
+    int m_refineDelayMs = DefaultRefineDelay;
+    bool m_refining = false;
+    QElapsedTimer m_lossyClock;
+    QTimer *m_refineTimer;
+
     bool m_debugTimingEnabled = false;
     int m_debugWindowMs = 1000;
     bool m_updateTimersPrimed = false;
@@ -2,20 +2,18 @@
 // SPDX-License-Identifier: LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
 
 #include "qnovncframecache.h"
+#include "qnovncpixelconverter.h"
 #include <QtCore/QSysInfo>
 #include <QtCore/QDebug>
 #include <QtCore/QMutexLocker>
 #include <QtCore/QtEndian>
 #include <QtCore/QtGlobal>
 
+#include <limits>
+
 QT_BEGIN_NAMESPACE
 
 #if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-uint qHash(const QRect &rect, uint seed)
-{
-    return qHash(rect.x(), seed) ^ qHash(rect.y(), seed) ^ qHash(rect.width(), seed) ^ qHash(rect.height(), seed);
-}
-
 uint qHash(const QNoVncEncodingConfig &config, uint seed)
 {
     const auto &pf = config.pixelFormat;
@@ -64,11 +62,29 @@ bool QNoVncEncodingConfig::operator==(const QNoVncEncodingConfig &other) const
 
 QNoVncFrameCache::QNoVncFrameCache(QObject *parent) : QObject(parent) {}
 
+void QNoVncFrameCache::invalidate(const QRegion &region)
+{
+    QMutexLocker locker(&m_mutex);
+    for (FormatCache &cache : m_cache) {
+        const QRect bounds(QPoint(0, 0), cache.size);
+        for (const QRect &changed : region) {
+            const QRect rect = changed & bounds;
+            if (rect.isEmpty())
+                continue;
+            for (int y = rect.top() / MAP_TILE_SIZE; y <= rect.bottom() / MAP_TILE_SIZE; ++y) {
+                const int row = y * cache.tilesPerRow;
+                cache.converted.fill(false, row + rect.left() / MAP_TILE_SIZE,
+                                     row + rect.right() / MAP_TILE_SIZE + 1);
+            }
+        }
+    }
+}
+
 void QNoVncFrameCache::invalidate()
 {
     QMutexLocker locker(&m_mutex);
-    m_currentFrameId++;
-    clear();
+    for (FormatCache &cache : m_cache)
+        cache.converted.fill(false);
 }
 
 void QNoVncFrameCache::clear()
@@ -76,55 +92,87 @@ void QNoVncFrameCache::clear()
     m_cache.clear();
 }
 
-QByteArray QNoVncFrameCache::getConvertedPixels(
+const uchar *QNoVncFrameCache::convertedPixels(
     const QImage &screenImage,
     const QRect &rect,
-    const QRfbPixelFormat &format)
+    const QNoVncPixelConverter &converter,
+    QByteArray *buffer,
+    qsizetype *stride)
 {
+    Q_ASSERT(screenImage.rect().contains(rect));
     QMutexLocker locker(&m_mutex);
-    
-    QNoVncEncodingConfig config { format };
-    auto &formatCache = m_cache[config];
-    formatCache.lastUsed = ++m_timer;
-
-    auto &cachedTile = formatCache.tiles[rect];
-    
-    if (cachedTile.frameId == m_currentFrameId && !cachedTile.rawData.isEmpty()) {
-        return cachedTile.rawData;
+
+    const QNoVncEncodingConfig config { converter.format() };
+    if (!m_cache.contains(config) && m_cache.size() >= MaxCachedFormats)
+        trimCache();
+    FormatCache &cache = m_cache[config];
+    cache.lastUsed = ++m_timer;
+
+    const int bytesPerPixel = converter.bytesPerPixel();
+    if (cache.size != screenImage.size()) {
+        cache.size = screenImage.size();
+        cache.stride = qsizetype(cache.size.width()) * bytesPerPixel;
+        cache.pixels.resize(cache.stride * cache.size.height());
+        cache.tilesPerRow = (cache.size.width() + MAP_TILE_SIZE - 1) / MAP_TILE_SIZE;
+        const int tileRows = (cache.size.height() + MAP_TILE_SIZE - 1) / MAP_TILE_SIZE;
+        cache.converted.fill(false, cache.tilesPerRow * tileRows);
     }
 
-    if (formatCache.tiles.size() > MaxTilesPerFormat) {
-        formatCache.tiles.clear();
-        return getConvertedPixels(screenImage, rect, format);
+    // Stale tiles under rect are converted whole, a run of them at a time
+    const int screenBytesPerPixel = screenImage.depth() / 8;
+    const qsizetype screenStride = screenImage.bytesPerLine();
+    char *pixels = cache.pixels.data();
+    const int left = rect.left() / MAP_TILE_SIZE;
+    const int right = rect.right() / MAP_TILE_SIZE;
+    for (int tileY = rect.top() / MAP_TILE_SIZE; tileY <= rect.bottom() / MAP_TILE_SIZE; ++tileY) {
+        const int row = tileY * cache.tilesPerRow;
+        int tileX = left;
+        while (tileX <= right) {
+            if (cache.converted.testBit(row + tileX)) {
+                ++tileX;
+                continue;
+            }
+            int end = tileX + 1;
+            while (end <= right && !cache.converted.testBit(row + end))
+                ++end;
+            cache.converted.fill(true, row + tileX, row + end);
+
+            const int x = tileX * MAP_TILE_SIZE;
+            const int width = qMin(end * MAP_TILE_SIZE, cache.size.width()) - x;
+            const int top = tileY * MAP_TILE_SIZE;
+            const int bottom = qMin(top + MAP_TILE_SIZE, cache.size.height());
+            for (int y = top; y < bottom; ++y) {
+                converter.convert(pixels + y * cache.stride + qsizetype(x) * bytesPerPixel,
+                                  reinterpret_cast<const char *>(screenImage.constScanLine(y))
+                                      + qsizetype(x) * screenBytesPerPixel,
+                                  width);
+            }
+            tileX = end;
+        }
     }
 
-    if (m_cache.size() > MaxCachedFormats) {
-        trimCache();
-        return getConvertedPixels(screenImage, rect, format);
+    const uchar *source = reinterpret_cast<const uchar *>(cache.pixels.constData())
+            + rect.y() * cache.stride + qsizetype(rect.x()) * bytesPerPixel;
+    if (stride) {
+        *stride = cache.stride;
+        return source;
     }
-    
-    const int bytesPerPixel = (format.bitsPerPixel + 7) / 8;
-    const int totalSize = rect.width() * rect.height() * bytesPerPixel;
-    cachedTile.rawData.resize(totalSize);
-    
-    char *destination = cachedTile.rawData.data();
-    const int screenDepth = screenImage.depth();
-    const int screenStride = screenImage.bytesPerLine();
-    const uchar *sourceLine = screenImage.scanLine(rect.y()) + rect.x() * screenDepth / 8;
-    
-    for (int i = 0; i < rect.height(); ++i) {
-        convertPixels(destination, reinterpret_cast<const char*>(sourceLine), rect.width(), screenDepth, format);
-        sourceLine += screenStride;
-        destination += rect.width() * bytesPerPixel;
+
+    const qsizetype rowBytes = qsizetype(rect.width()) * bytesPerPixel;
+    if (buffer->size() < rowBytes * rect.height())
+        buffer->resize(rowBytes * rect.height());
+    uchar *dst = reinterpret_cast<uchar *>(buffer->data());
+    for (int y = 0; y < rect.height(); ++y) {
+        memcpy(dst, source, rowBytes);
+        source += cache.stride;
+        dst += rowBytes;
     }
-    
-    cachedTile.frameId = m_currentFrameId;
-    return cachedTile.rawData;
+    return reinterpret_cast<const uchar *>(buffer->constData());
 }
 
 void QNoVncFrameCache::trimCache()
 {
-    if (m_cache.size() <= MaxCachedFormats)
+    if (m_cache.isEmpty())
         return;
 
     QNoVncEncodingConfig lruKey;
@@ -144,49 +192,4 @@ void QNoVncFrameCache::trimCache()
     }
 }
 
-void QNoVncFrameCache::convertPixels(char *dst, const char *src, const int count, const int screendepth, const QRfbPixelFormat &pixelFormat) const
-{
-    const int bytesPerPixel = (pixelFormat.bitsPerPixel + 7) / 8;
-    const bool sameEndian = QSysInfo::ByteOrder == QSysInfo::BigEndian == !!pixelFormat.bigEndian;
-
-    for (int i = 0; i < count; ++i) {
-        int r, g, b;
-        switch (screendepth) {
-        case 32: {
-            const quint32 p = *reinterpret_cast<const quint32*>(src);
-            r = p >> 16 & 0xff; g = p >> 8 & 0xff; b = p & 0xff;
-            src += 4; break;
-        }
-        case 16: {
-            const quint16 p = *reinterpret_cast<const quint16*>(src);
-            r = (p >> 11 & 0x1f) << 3; g = (p >> 5 & 0x3f) << 2; b = (p & 0x1f) << 3;
-            src += 2; break;
-        }
-        default: r = g = b = 0; break;
-        }
-
-        r >>= 8 - pixelFormat.redBits;
-        g >>= 8 - pixelFormat.greenBits;
-        b >>= 8 - pixelFormat.blueBits;
-
-        int pixel = r << pixelFormat.redShift | g << pixelFormat.greenShift | b << pixelFormat.blueShift;
-
-        if (sameEndian || pixelFormat.bitsPerPixel == 8) {
-            memcpy(dst, &pixel, bytesPerPixel);
-        } else {
-            if (pixelFormat.bitsPerPixel == 16) {
-                pixel = (pixel & 0xff) << 8 | (pixel & 0xff00) >> 8;
-            } else if (pixelFormat.bitsPerPixel == 32) {
-                const quint32 p = static_cast<quint32>(pixel);
-                pixel = static_cast<int>((p & 0xff000000) >> 24 |
-                                         (p & 0x00ff0000) >> 8  |
-                                         (p & 0x0000ff00) << 8  |
-                                         (p & 0x000000ff) << 24);
-            }
-            memcpy(dst, &pixel, bytesPerPixel);
-        }
-        dst += bytesPerPixel;
-    }
-}
-
 QT_END_NAMESPACE
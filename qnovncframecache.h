@@ -4,15 +4,20 @@
 #ifndef QNOVNCFRAMECACHE_H
 #define QNOVNCFRAMECACHE_H
 
+#include <QtCore/QBitArray>
 #include <QtCore/QByteArray>
 #include <QtCore/QHash>
 #include <QtCore/QMutex>
 #include <QtCore/QRect>
+#include <QtGui/QRegion>
+#include <QtCore/QSize>
 
 #include "qnovnc_p.h"
 
 QT_BEGIN_NAMESPACE
 
+class QNoVncPixelConverter;
+
 struct QNoVncEncodingConfig
 {
     QRfbPixelFormat pixelFormat;
@@ -22,22 +27,21 @@ struct QNoVncEncodingConfig
 
 #if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
 uint qHash(const QNoVncEncodingConfig &config, uint seed = 0);
-uint qHash(const QRect &rect, uint seed = 0);
 #else
 size_t qHash(const QNoVncEncodingConfig &config, size_t seed = 0);
 #endif
 
 /**
- * @brief Holds pre-converted (but NOT compressed) pixel data
+ * @brief Holds the screen converted (but NOT compressed) to each client
+ * pixel format in use
+ *
+ * Each format keeps a converted copy of the whole screen in one buffer,
+ * split into the dirty map's MAP_TILE_SIZE tiles. A tile is converted the
+ * first time a client needs it after it changed, and any rect is read from
+ * the converted tiles, so clients whose updates differ in shape still
+ * share the work. Tiles stay valid across frames until the screen changes
+ * them.
  */
-struct QNoVncCachedTile
-{
-    QByteArray rawData;
-    quint64 frameId;
-
-    QNoVncCachedTile() : frameId(0) {}
-};
-
 class QNoVncFrameCache : public QObject
 {
     Q_OBJECT
@@ -45,28 +49,37 @@ class QNoVncFrameCache : public QObject
 public:
     explicit QNoVncFrameCache(QObject *parent = nullptr);
     
-    QByteArray getConvertedPixels(
+    // rect of screenImage in the converter's format. With stride the
+    // pixels are read in place, valid until the next call; otherwise they
+    // are copied into buffer.
+    const uchar *convertedPixels(
         const QImage &screenImage,
         const QRect &rect,
-        const QRfbPixelFormat &format);
+        const QNoVncPixelConverter &converter,
+        QByteArray *buffer,
+        qsizetype *stride);
 
+    // Marks the tiles in region, or all of them, as changed on the screen
+    void invalidate(const QRegion &region);
     void invalidate();
     void clear();
 
 private:
-    void convertPixels(char *dst, const char *src, int count, int screendepth, const QRfbPixelFormat &pixelFormat) const;
-
-    mutable QMutex m_mutex;
-    quint64 m_currentFrameId = 0;
     struct FormatCache {
-        QHash<QRect, QNoVncCachedTile> tiles;
+        QByteArray pixels;
+        qsizetype stride = 0;
+        QSize size;
+        int tilesPerRow = 0;
+        QBitArray converted;
         quint64 lastUsed = 0;
     };
+
+    mutable QMutex m_mutex;
     QHash<QNoVncEncodingConfig, FormatCache> m_cache;
     quint64 m_timer = 0;
 
-    static constexpr int MaxCachedFormats = 10;
-    static constexpr int MaxTilesPerFormat = 1000;
+    // Each format holds a whole screen
+    static constexpr int MaxCachedFormats = 4;
 
     void trimCache();
 };
@@ -0,0 +1,229 @@
+// Copyright (C) 2026 CraftingDragon007
+// SPDX-License-Identifier: LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+#include "qnovnch264encoder.h"
+#include "qnovncclient.h"
+#include "qnovncpixelconverter.h"
+#include <QtCore/QDebug>
+#include <QtCore/QtEndian>
+
+#include <wels/codec_api.h>
+
+QT_BEGIN_NAMESPACE
+
+QRfbH264Encoder::QRfbH264Encoder(QNoVncClient *s)
+    : QRfbEncoder(s)
+{
+}
+
+QRfbH264Encoder::~QRfbH264Encoder()
+{
+    releaseEncoder();
+}
+
+bool QRfbH264Encoder::initEncoder(const QSize &size)
+{
+    if (WelsCreateSVCEncoder(&m_encoder) != 0 || !m_encoder) {
+        qWarning(lcVnc) << "Could not create the H.264 encoder";
+        m_encoder = nullptr;
+        return false;
+    }
+
+    const int bitrate = qEnvironmentVariableIntValue("QNOVNC_H264_BITRATE");
+    const float frameRate = float(qMax(1, client->server()->screen()->refreshRate));
+
+    SEncParamExt param;
+    m_encoder->GetDefaultParams(&param);
+    param.iUsageType = CAMERA_VIDEO_REAL_TIME;
+    param.iPicWidth = size.width();
+    param.iPicHeight = size.height();
+    param.iTargetBitrate = (bitrate > 0 ? bitrate : int(DefaultBitrate)) * 1000;
+    param.iRCMode = RC_BITRATE_MODE;
+    param.fMaxFrameRate = frameRate;
+    // Every update request must be answered with a frame
+    param.bEnableFrameSkip = false;
+    // Only the first frame is an IDR; later ones are forced on a reset
+    param.uiIntraPeriod = 0;
+    param.eSpsPpsIdStrategy = CONSTANT_ID;
+    param.iSpatialLayerNum = 1;
+    param.iTemporalLayerNum = 1;
+
+    SSpatialLayerConfig &layer = param.sSpatialLayers[0];
+    layer.iVideoWidth = size.width();
+    layer.iVideoHeight = size.height();
+    layer.fFrameRate = frameRate;
+    layer.iSpatialBitrate = param.iTargetBitrate;
+    layer.sSliceArgument.uiSliceMode = SM_SINGLE_SLICE;
+
+    if (m_encoder->InitializeExt(&param) != cmResultSuccess) {
+        qWarning(lcVnc) << "Could not initialize the H.264 encoder for" << size;
+        releaseEncoder();
+        return false;
+    }
+    int videoFormat = videoFormatI420;
+    m_encoder->SetOption(ENCODER_OPTION_DATAFORMAT, &videoFormat);
+
+    m_frameSize = size;
+    m_yuv.resize(qsizetype(size.width()) * size.height() * 3 / 2);
+    m_clock.start();
+    m_resetContext = true;
+    return true;
+}
+
+void QRfbH264Encoder::releaseEncoder()
+{
+    if (m_encoder) {
+        m_encoder->Uninitialize();
+        WelsDestroySVCEncoder(m_encoder);
+        m_encoder = nullptr;
+    }
+    m_frameSize = QSize();
+}
+
+// Reads 32 bpp pixels with the channels at the given shifts, so the screen
+// image is used in place whichever byte order it keeps
+template <int RedShift, int GreenShift, int BlueShift>
+void QRfbH264Encoder::convertToI420(const QImage &image)
+{
+    // BT.601 limited range, chroma averaged over each 2x2 block
+    const int width = m_frameSize.width();
+    const int height = m_frameSize.height();
+    uchar *yPlane = reinterpret_cast<uchar *>(m_yuv.data());
+    uchar *uPlane = yPlane + qsizetype(width) * height;
+    uchar *vPlane = uPlane + qsizetype(width / 2) * (height / 2);
+
+    for (int y = 0; y < height; y += 2) {
+        const quint32 *src0 = reinterpret_cast<const quint32 *>(image.constScanLine(y));
+        const quint32 *src1 = reinterpret_cast<const quint32 *>(image.constScanLine(y + 1));
+        uchar *y0 = yPlane + qsizetype(y) * width;
+        uchar *y1 = y0 + width;
+        uchar *u = uPlane + qsizetype(y / 2) * (width / 2);
+        uchar *v = vPlane + qsizetype(y / 2) * (width / 2);
+        for (int x = 0; x < width; x += 2) {
+            const quint32 p[4] = { src0[x], src0[x + 1], src1[x], src1[x + 1] };
+            int r = 0;
+            int g = 0;
+            int b = 0;
+            for (int i = 0; i < 4; ++i) {
+                const int pr = (p[i] >> RedShift) & 0xff;
+                const int pg = (p[i] >> GreenShift) & 0xff;
+                const int pb = (p[i] >> BlueShift) & 0xff;
+                const uchar luma = uchar(((66 * pr + 129 * pg + 25 * pb + 128) >> 8) + 16);
+                (i < 2 ? y0 : y1)[x + (i & 1)] = luma;
+                r += pr;
+                g += pg;
+                b += pb;
+            }
+            r = (r + 2) >> 2;
+            g = (g + 2) >> 2;
+            b = (b + 2) >> 2;
+            *u++ = uchar(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            *v++ = uchar(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+    }
+}
+
+bool QRfbH264Encoder::encodeFrame(const QImage &image)
+{
+    const QSize size(image.width() & ~1, image.height() & ~1);
+    if (size != m_frameSize) {
+        releaseEncoder();
+        if (!initEncoder(size))
+            return false;
+    }
+
+    const QRfbPixelFormat format = QNoVncPixelConverter::screenFormat(image.format());
+    const bool direct = format.trueColor && format.bitsPerPixel == 32;
+    if (direct && format.redShift == 16 && format.greenShift == 8 && format.blueShift == 0)
+        convertToI420<16, 8, 0>(image);
+    else if (direct && format.redShift == 0 && format.greenShift == 8 && format.blueShift == 16)
+        convertToI420<0, 8, 16>(image);
+    else if (direct && format.redShift == 24 && format.greenShift == 16 && format.blueShift == 8)
+        convertToI420<24, 16, 8>(image);
+    else
+        convertToI420<16, 8, 0>(image.convertToFormat(QImage::Format_RGB32));
+
+    SSourcePicture picture;
+    memset(&picture, 0, sizeof(picture));
+    picture.iColorFormat = videoFormatI420;
+    picture.iPicWidth = m_frameSize.width();
+    picture.iPicHeight = m_frameSize.height();
+    picture.iStride[0] = m_frameSize.width();
+    picture.iStride[1] = picture.iStride[2] = m_frameSize.width() / 2;
+    picture.pData[0] = reinterpret_cast<unsigned char *>(m_yuv.data());
+    picture.pData[1] = picture.pData[0] + qsizetype(m_frameSize.width()) * m_frameSize.height();
+    picture.pData[2] = picture.pData[1] + qsizetype(m_frameSize.width() / 2) * (m_frameSize.height() / 2);
+    picture.uiTimeStamp = m_clock.elapsed();
+
+    if (m_resetContext)
+        m_encoder->ForceIntraFrame(true);
+
+    SFrameBSInfo info;
+    memset(&info, 0, sizeof(info));
+    if (m_encoder->EncodeFrame(&picture, &info) != cmResultSuccess) {
+        qWarning(lcVnc) << "H.264 encoding failed";
+        m_resetContext = true;
+        return false;
+    }
+    if (info.eFrameType == videoFrameTypeSkip)
+        return false;
+
+    // The layers hold Annex B NAL units, which is what the client expects
+    m_frame.clear();
+    for (int i = 0; i < info.iLayerNum; ++i) {
+        const SLayerBSInfo &layer = info.sLayerInfo[i];
+        qsizetype layerSize = 0;
+        for (int j = 0; j < layer.iNalCount; ++j)
+            layerSize += layer.pNalLengthInByte[j];
+        m_frame.append(reinterpret_cast<const char *>(layer.pBsBuf), layerSize);
+    }
+    return !m_frame.isEmpty();
+}
+
+void QRfbH264Encoder::write()
+{
+    QIODevice *socket = client->clientSocket();
+    QRegion rgn = client->dirtyRegion();
+    qCDebug(lcVnc) << "QRfbH264Encoder::write()" << rgn;
+
+    const QImage screenImage = updateImage(&rgn);
+
+    if (screenImage.width() < 2 || screenImage.height() < 2 || !encodeFrame(screenImage)) {
+        writeUpdateHeader(socket, rgn.rectCount());
+        for (const QRect &rect : rgn)
+            writeRect(socket, screenImage, rect);
+        return;
+    }
+
+    QRect strips[2];
+    int stripCount = 0;
+    if (screenImage.width() > m_frameSize.width())
+        strips[stripCount++] = QRect(m_frameSize.width(), 0, 1, screenImage.height());
+    if (screenImage.height() > m_frameSize.height())
+        strips[stripCount++] = QRect(0, m_frameSize.height(), m_frameSize.width(), 1);
+
+    writeUpdateHeader(socket, 1 + stripCount);
+
+    // A new encoder starts a new stream, so stale contexts of other sizes go too
+    const quint32 header[2] = {
+        qToBigEndian(quint32(m_frame.size())),
+        qToBigEndian(quint32(m_resetContext ? ResetAllContexts : 0))
+    };
+    m_resetContext = false;
+    writeRectHeader(socket, QRect(QPoint(0, 0), m_frameSize), H264Encoding);
+    socket->write(reinterpret_cast<const char *>(header), sizeof(header));
+    socket->write(m_frame);
+
+    for (int i = 0; i < stripCount; ++i)
+        writeRect(socket, screenImage, strips[i]);
+}
+
+void QRfbH264Encoder::writeRect(QIODevice *socket, const QImage &screenImage, const QRect &rect)
+{
+    // Only used for what cannot go into the frame, which is sent raw
+    qsizetype stride = 0;
+    const uchar *pixels = clientPixels(screenImage, rect, &m_pixelBuffer, &stride);
+    writeRawRect(socket, rect, pixels, stride);
+}
+
+QT_END_NAMESPACE
@@ -0,0 +1,60 @@
+// Copyright (C) 2026 CraftingDragon007
+// SPDX-License-Identifier: LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+#ifndef QNOVNCH264ENCODER_H
+#define QNOVNCH264ENCODER_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QSize>
+
+#include "qnovnc_p.h"
+
+class ISVCEncoder;
+
+QT_BEGIN_NAMESPACE
+
+/**
+ * @brief Streams the whole screen as H.264 (RFB encoding 50) using openh264
+ *
+ * Every update encodes one frame of the screen into a single rect, so the
+ * client keeps one decoder context for the lifetime of the encoder. 4:2:0
+ * needs even dimensions; an odd last column or row is sent raw.
+ */
+class QRfbH264Encoder : public QRfbEncoder
+{
+public:
+    QRfbH264Encoder(QNoVncClient *s);
+    ~QRfbH264Encoder();
+
+    void write() override;
+    void writeRect(QIODevice *socket, const QImage &screenImage, const QRect &rect) override;
+
+private:
+    enum Flags {
+        ResetContext = 1,
+        ResetAllContexts = 2
+    };
+    enum {
+        H264Encoding = 50,
+        DefaultBitrate = 4000 // kbit/s
+    };
+
+    bool initEncoder(const QSize &size);
+    void releaseEncoder();
+    template <int RedShift, int GreenShift, int BlueShift>
+    void convertToI420(const QImage &image);
+    bool encodeFrame(const QImage &image);
+
+    ISVCEncoder *m_encoder = nullptr;
+    QSize m_frameSize;
+    QByteArray m_yuv;
+    QByteArray m_frame;
+    QByteArray m_pixelBuffer;
+    QElapsedTimer m_clock;
+    bool m_resetContext = true;
+};
+
+QT_END_NAMESPACE
+
+#endif // QNOVNCH264ENCODER_H
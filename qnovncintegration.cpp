@@ -4,6 +4,7 @@
 #include "qnovncintegration.h"
 #include "qnovncscreen.h"
 #include "qnovncwindow.h"
+#include "qnovncbackingstore.h"
 #include "qnovnc_p.h"
 
 #if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
@@ -156,7 +157,7 @@ bool QNoVncIntegration::hasCapability(QPlatformIntegration::Capability cap) cons
 
 QPlatformBackingStore *QNoVncIntegration::createPlatformBackingStore(QWindow *window) const
 {
-    return new QFbBackingStore(window);
+    return new QNoVncBackingStore(window);
 }
 
 QPlatformWindow *QNoVncIntegration::createPlatformWindow(QWindow *window) const
@@ -0,0 +1,326 @@
+// Copyright (C) 2026 CraftingDragon007
+// SPDX-License-Identifier: LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+#include "qnovncpixelconverter.h"
+#include <QtCore/QSysInfo>
+#include <QtCore/QtEndian>
+
+#include <algorithm>
+#include <cstring>
+
+QT_BEGIN_NAMESPACE
+
+namespace {
+
+typedef QNoVncSimd::PixelConversion Conversion;
+
+// A screen pixel; 16 bpp ones are widened to 0x00RRGGBB
+template <int ScreenDepth>
+inline quint32 readPixel(const char *src)
+{
+    if (ScreenDepth == 32)
+        return *reinterpret_cast<const quint32 *>(src);
+    const quint32 p = *reinterpret_cast<const quint16 *>(src);
+    return (p & 0xf800) << 8 | (p & 0x07e0) << 5 | (p & 0x001f) << 3;
+}
+
+template <int Bytes, bool BigEndian>
+inline void writePixel(char *dst, quint32 pixel)
+{
+    if (Bytes == 1)
+        *dst = char(pixel);
+    else if (Bytes == 2 && BigEndian)
+        qToBigEndian(quint16(pixel), dst);
+    else if (Bytes == 2)
+        qToLittleEndian(quint16(pixel), dst);
+    else if (BigEndian)
+        qToBigEndian(pixel, dst);
+    else
+        qToLittleEndian(pixel, dst);
+}
+
+template <int Bits, int Shift>
+inline quint32 channel(quint32 p, int offset)
+{
+    return (p >> (offset - Bits) & ((1u << Bits) - 1)) << Shift;
+}
+
+// Channel layout known at compile time, on both sides: a 32 bpp screen
+// pixel has red in the third byte, or in the first when SourceBgr is set
+template <int Bytes, bool BigEndian, bool SourceBgr,
+          int RedBits, int GreenBits, int BlueBits,
+          int RedShift, int GreenShift, int BlueShift>
+void convertFixed(char *dst, const char *src, int count, const Conversion &)
+{
+    for (int i = 0; i < count; ++i) {
+        const quint32 p = readPixel<32>(src);
+        writePixel<Bytes, BigEndian>(dst, channel<RedBits, RedShift>(p, SourceBgr ? 8 : 24)
+                                          | channel<GreenBits, GreenShift>(p, 16)
+                                          | channel<BlueBits, BlueShift>(p, SourceBgr ? 24 : 8));
+        src += 4;
+        dst += Bytes;
+    }
+}
+
+// Channel layout from the conversion
+template <int ScreenDepth, int Bytes, bool BigEndian>
+void convertGeneric(char *dst, const char *src, int count, const Conversion &c)
+{
+    for (int i = 0; i < count; ++i) {
+        const quint32 p = readPixel<ScreenDepth>(src);
+        writePixel<Bytes, BigEndian>(dst, (p >> c.inShift[0] & c.mask[0]) << c.outShift[0]
+                                          | (p >> c.inShift[1] & c.mask[1]) << c.outShift[1]
+                                          | (p >> c.inShift[2] & c.mask[2]) << c.outShift[2]);
+        src += ScreenDepth / 8;
+        dst += Bytes;
+    }
+}
+
+// Screen depths and client sizes no kernel handles come out black
+void convertUnsupported(char *dst, const char *, int count, const Conversion &c)
+{
+    memset(dst, 0, size_t(count) * c.bytesPerPixel);
+}
+
+// Screen pixels are 8 or 16 bit indices into a table of client pixels, kept
+// in wire byte order. Conversion from RGB 565 only selects and moves bits,
+// so a pixel converts to the low byte's entry ORed with the high byte's,
+// and 512 entries do the work of 65536.
+template <int ScreenDepth, int Bytes>
+void convertLookup(char *dst, const char *src, int count, const quint32 *lookup)
+{
+    for (int i = 0; i < count; ++i) {
+        quint32 pixel;
+        if (ScreenDepth == 8) {
+            pixel = lookup[uchar(src[i])];
+        } else {
+            const quint16 p = reinterpret_cast<const quint16 *>(src)[i];
+            pixel = lookup[p & 0xff] | lookup[256 + (p >> 8)];
+        }
+        memcpy(dst, &pixel, Bytes);
+        dst += Bytes;
+    }
+}
+
+typedef void (*Kernel)(char *, const char *, int, const Conversion &);
+typedef void (*LookupKernel)(char *, const char *, int, const quint32 *);
+
+#define QNOVNC_FIXED_KERNELS(bytes, rb, gb, bb, rs, gs, bs) \
+    { bytes, { rb, gb, bb }, { rs, gs, bs }, { \
+        { convertFixed<bytes, false, false, rb, gb, bb, rs, gs, bs>, \
+          convertFixed<bytes, true, false, rb, gb, bb, rs, gs, bs> }, \
+        { convertFixed<bytes, false, true, rb, gb, bb, rs, gs, bs>, \
+          convertFixed<bytes, true, true, rb, gb, bb, rs, gs, bs> } } }
+
+struct FixedLayout
+{
+    int bytesPerPixel;
+    int bits[3];
+    int shifts[3];
+    // By screen layout (xRGB, xBGR) and client byte order (little, big)
+    Kernel kernels[2][2];
+};
+
+// noVNC asks for depth / 3 bits per channel, red lowest
+const FixedLayout fixedLayouts[] = {
+    QNOVNC_FIXED_KERNELS(4, 8, 8, 8, 16, 8, 0),  // xRGB 8888
+    QNOVNC_FIXED_KERNELS(4, 8, 8, 8, 0, 8, 16),  // xBGR 8888, noVNC
+    QNOVNC_FIXED_KERNELS(2, 5, 6, 5, 11, 5, 0),  // RGB 565
+    QNOVNC_FIXED_KERNELS(2, 5, 5, 5, 10, 5, 0),  // RGB 555
+    QNOVNC_FIXED_KERNELS(2, 5, 5, 5, 0, 5, 10),  // BGR 555, noVNC
+    QNOVNC_FIXED_KERNELS(1, 3, 3, 2, 0, 3, 6),   // BGR 233
+    QNOVNC_FIXED_KERNELS(1, 2, 2, 2, 0, 2, 4),   // BGR 222, noVNC
+};
+
+#undef QNOVNC_FIXED_KERNELS
+
+#define QNOVNC_GENERIC_KERNELS(depth, bytes) \
+    { convertGeneric<depth, bytes, false>, convertGeneric<depth, bytes, true> }
+
+// By screen depth (32, 16), client bytes per pixel (1, 2, 4) and byte order
+const Kernel genericKernels[2][3][2] = {
+    { QNOVNC_GENERIC_KERNELS(32, 1), QNOVNC_GENERIC_KERNELS(32, 2), QNOVNC_GENERIC_KERNELS(32, 4) },
+    { QNOVNC_GENERIC_KERNELS(16, 1), QNOVNC_GENERIC_KERNELS(16, 2), QNOVNC_GENERIC_KERNELS(16, 4) },
+};
+
+#undef QNOVNC_GENERIC_KERNELS
+
+// By screen depth (16, 8) and client bytes per pixel (1, 2, 4)
+const LookupKernel lookupKernels[2][3] = {
+    { convertLookup<16, 1>, convertLookup<16, 2>, convertLookup<16, 4> },
+    { convertLookup<8, 1>, convertLookup<8, 2>, convertLookup<8, 4> },
+};
+
+} // namespace
+
+QNoVncPixelConverter::QNoVncPixelConverter()
+    : m_kernel(convertUnsupported),
+      m_lookupKernel(nullptr),
+      m_screenDepth(0),
+      m_identity(false),
+      m_vectorizable(false)
+{
+    memset(&m_conversion, 0, sizeof(m_conversion));
+}
+
+QRfbPixelFormat QNoVncPixelConverter::screenFormat(QImage::Format imageFormat)
+{
+    QRfbPixelFormat format;
+    format.bigEndian = QSysInfo::ByteOrder == QSysInfo::BigEndian;
+    format.trueColor = true;
+    switch (imageFormat) {
+    case QImage::Format_RGB16:
+        format.bitsPerPixel = 16;
+        format.depth = 16;
+        format.redBits = 5;
+        format.greenBits = 6;
+        format.blueBits = 5;
+        format.redShift = 11;
+        format.greenShift = 5;
+        format.blueShift = 0;
+        break;
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBA8888_Premultiplied:
+        // Bytes R, G, B, A, whatever the host reads them as
+        format.bitsPerPixel = 32;
+        format.depth = 24;
+        format.redBits = format.greenBits = format.blueBits = 8;
+        format.redShift = format.bigEndian ? 24 : 0;
+        format.greenShift = format.bigEndian ? 16 : 8;
+        format.blueShift = format.bigEndian ? 8 : 16;
+        break;
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+        format.bitsPerPixel = 32;
+        format.depth = 24;
+        format.redBits = format.greenBits = format.blueBits = 8;
+        format.redShift = 16;
+        format.greenShift = 8;
+        format.blueShift = 0;
+        break;
+    default:
+        format.bitsPerPixel = QImage::toPixelFormat(imageFormat).bitsPerPixel();
+        format.depth = format.bitsPerPixel;
+        format.trueColor = false;
+        break;
+    }
+    return format;
+}
+
+bool QNoVncPixelConverter::sameLayout(const QRfbPixelFormat &a, const QRfbPixelFormat &b)
+{
+    return a.trueColor && b.trueColor
+            && a.bitsPerPixel == b.bitsPerPixel
+            && (a.bitsPerPixel == 8 || a.bigEndian == b.bigEndian)
+            && a.redBits == b.redBits && a.greenBits == b.greenBits && a.blueBits == b.blueBits
+            && a.redShift == b.redShift && a.greenShift == b.greenShift && a.blueShift == b.blueShift;
+}
+
+void QNoVncPixelConverter::setFormat(const QRfbPixelFormat &format, const QImage &screenImage)
+{
+    const int screenDepth = screenImage.depth();
+    m_format = format;
+    m_screenDepth = screenDepth;
+    m_lookupKernel = nullptr;
+    m_lookup.clear();
+
+    // Where the channels' top bits are in a screen pixel as the kernels read it
+    const QRfbPixelFormat source = screenFormat(screenImage.format());
+    const bool sourceBgr = screenDepth == 32 && source.redShift == 0 && source.blueShift == 16;
+    const bool sourceRgb = screenDepth != 32 || (source.redShift == 16 && source.blueShift == 0);
+    const int sourceShifts[3] = {
+        screenDepth == 32 ? source.redShift : 16,
+        screenDepth == 32 ? source.greenShift : 8,
+        screenDepth == 32 ? source.blueShift : 0
+    };
+
+    const int bits[3] = { format.redBits, format.greenBits, format.blueBits };
+    const int shifts[3] = { format.redShift, format.greenShift, format.blueShift };
+    m_vectorizable = screenDepth != 8;
+    for (int i = 0; i < 3; ++i) {
+        // The screen has no more than 8 bits per channel to give
+        const int used = qBound(0, bits[i], 8);
+        m_vectorizable = m_vectorizable && bits[i] <= 8;
+        m_conversion.inShift[i] = sourceShifts[i] + 8 - used;
+        m_conversion.mask[i] = (1u << used) - 1;
+        m_conversion.outShift[i] = shifts[i];
+    }
+    m_conversion.bytesPerPixel = (format.bitsPerPixel + 7) / 8;
+    const bool bigEndian = format.bitsPerPixel != 8 && format.bigEndian;
+    m_conversion.swapBytes = format.bitsPerPixel != 8
+            && (QSysInfo::ByteOrder == QSysInfo::BigEndian) != bigEndian;
+
+    m_identity = sameLayout(format, source);
+
+    const int depthIndex = screenDepth == 32 ? 0 : screenDepth == 16 ? 1 : screenDepth == 8 ? 2 : -1;
+    const int bytesIndex = m_conversion.bytesPerPixel == 1 ? 0
+            : m_conversion.bytesPerPixel == 2 ? 1
+            : m_conversion.bytesPerPixel == 4 ? 2 : -1;
+    if (depthIndex < 0 || bytesIndex < 0) {
+        qWarning("QNoVncPixelConverter: cannot convert %dbpp screen to %dbpp client",
+                 screenDepth, format.bitsPerPixel);
+        m_kernel = convertUnsupported;
+        m_vectorizable = false;
+        return;
+    }
+
+    if (screenDepth == 32) {
+        m_kernel = genericKernels[0][bytesIndex][bigEndian];
+        for (const FixedLayout &layout : fixedLayouts) {
+            if ((sourceRgb || sourceBgr)
+                && layout.bytesPerPixel == m_conversion.bytesPerPixel
+                && std::equal(bits, bits + 3, layout.bits)
+                && std::equal(shifts, shifts + 3, layout.shifts)) {
+                m_kernel = layout.kernels[sourceBgr][bigEndian];
+                break;
+            }
+        }
+        return;
+    }
+
+    // Fill the table by converting each index, or each byte of an RGB 565
+    // pixel on its own, with the generic kernel
+    m_lookupKernel = lookupKernels[depthIndex - 1][bytesIndex];
+    m_lookup.fill(0, screenDepth == 16 ? 512 : 256);
+    quint32 *entry = m_lookup.data();
+    if (screenDepth == 16) {
+        const Kernel kernel = genericKernels[1][bytesIndex][bigEndian];
+        for (int i = 0; i < 512; ++i) {
+            const quint16 p = i < 256 ? quint16(i) : quint16((i - 256) << 8);
+            kernel(reinterpret_cast<char *>(entry + i), reinterpret_cast<const char *>(&p), 1, m_conversion);
+        }
+    } else {
+        // Colour table entries are 0xAARRGGBB, so the shifts change to match
+        Conversion conversion = m_conversion;
+        for (int i = 0; i < 3; ++i)
+            conversion.inShift[i] = 16 - 8 * i + 8 - qBound(0, bits[i], 8);
+        const Kernel kernel = genericKernels[0][bytesIndex][bigEndian];
+        const QVector<QRgb> colorTable = screenImage.colorTable();
+        for (int i = 0; i < colorTable.size() && i < 256; ++i) {
+            const quint32 p = colorTable.at(i);
+            kernel(reinterpret_cast<char *>(entry + i), reinterpret_cast<const char *>(&p), 1, conversion);
+        }
+    }
+}
+
+void QNoVncPixelConverter::convert(char *dst, const char *src, int count) const
+{
+    if (m_identity) {
+        memcpy(dst, src, size_t(count) * m_conversion.bytesPerPixel);
+        return;
+    }
+
+    const int done = m_vectorizable
+            ? QNoVncSimd::convertPixels(dst, src, count, m_screenDepth, m_conversion)
+            : 0;
+    dst += done * m_conversion.bytesPerPixel;
+    src += done * m_screenDepth / 8;
+    if (m_lookupKernel)
+        m_lookupKernel(dst, src, count - done, m_lookup.constData());
+    else
+        m_kernel(dst, src, count - done, m_conversion);
+}
+
+QT_END_NAMESPACE
@@ -0,0 +1,61 @@
+// Copyright (C) 2026 CraftingDragon007
+// SPDX-License-Identifier: LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+#ifndef QNOVNCPIXELCONVERTER_H
+#define QNOVNCPIXELCONVERTER_H
+
+#include <QtCore/QVector>
+#include <QtGui/QImage>
+
+#include "qnovnc_p.h"
+#include "qnovncsimd.h"
+
+QT_BEGIN_NAMESPACE
+
+/**
+ * @brief Converts rows of screen pixels to the pixel format of one client
+ *
+ * The kernel is picked once, when the client sets its format. For 32 bpp
+ * screens it is a template over client bytes per pixel and byte order, and
+ * for the common client formats over the channel layout as well; other
+ * layouts read their shifts at runtime. 16 and 8 bpp screens look their
+ * pixels up in a table of client pixels built at the same time. The
+ * QNoVncSimd kernels do the bulk of each row when the CPU has them.
+ */
+class QNoVncPixelConverter
+{
+public:
+    QNoVncPixelConverter();
+
+    // The RFB description of a screen image format in host byte order
+    static QRfbPixelFormat screenFormat(QImage::Format imageFormat);
+    // Pixels of format a are byte for byte pixels of format b
+    static bool sameLayout(const QRfbPixelFormat &a, const QRfbPixelFormat &b);
+
+    void setFormat(const QRfbPixelFormat &format, const QImage &screenImage);
+    const QRfbPixelFormat &format() const { return m_format; }
+    int bytesPerPixel() const { return m_conversion.bytesPerPixel; }
+    // Screen pixels are already in the client format
+    bool isIdentity() const { return m_identity; }
+
+    void convert(char *dst, const char *src, int count) const;
+
+private:
+    typedef void (*Kernel)(char *dst, const char *src, int count,
+                           const QNoVncSimd::PixelConversion &conversion);
+    typedef void (*LookupKernel)(char *dst, const char *src, int count,
+                                 const quint32 *lookup);
+
+    QRfbPixelFormat m_format;
+    QNoVncSimd::PixelConversion m_conversion;
+    Kernel m_kernel;
+    LookupKernel m_lookupKernel;
+    QVector<quint32> m_lookup;
+    int m_screenDepth;
+    bool m_identity;
+    bool m_vectorizable;
+};
+
+QT_END_NAMESPACE
+
+#endif // QNOVNCPIXELCONVERTER_H
@@ -7,6 +7,7 @@
 
 #include "qnovnc_p.h"
 #include "qnovncwindow.h"
+#include "qnovncbackingstore.h"
 #include <QtFbSupport/private/qfbwindow_p.h>
 #include <QtFbSupport/private/qfbcursor_p.h>
 
@@ -14,10 +15,182 @@
 #include <QtGui/QScreen>
 #include <QtCore/QRegularExpression>
 #include <QtCore/QStringLiteral>
+#include <QtCore/QHash>
+#include <QtCore/QVarLengthArray>
+
+#include <algorithm>
 
 
 QT_BEGIN_NAMESPACE
 
+namespace {
+// Smallest rect searched for scrolling, and smallest run of moved lines
+// worth a CopyRect
+enum { MinScrollSize = 32, MinScrollRun = 8, MinScrollVotes = 4 };
+
+inline quint64 mixHash(quint64 h, quint32 v)
+{
+    return (h ^ v) * Q_UINT64_C(0x100000001b3);
+}
+
+// Hashes every row of rect when vertical, every column otherwise
+template <class T>
+void hashLines(const QImage &image, const QRect &rect, bool vertical, QVector<quint64> *hashes)
+{
+    if (vertical) {
+        hashes->resize(rect.height());
+        quint64 *h = hashes->data();
+        for (int y = 0; y < rect.height(); ++y) {
+            h[y] = qHashBits(image.constScanLine(rect.y() + y) + rect.x() * sizeof(T),
+                             rect.width() * sizeof(T));
+        }
+        return;
+    }
+
+    hashes->fill(Q_UINT64_C(0xcbf29ce484222325), rect.width());
+    quint64 *h = hashes->data();
+    for (int y = 0; y < rect.height(); ++y) {
+        const T *row = reinterpret_cast<const T *>(image.constScanLine(rect.y() + y)) + rect.x();
+        for (int x = 0; x < rect.width(); ++x)
+            h[x] = mixHash(h[x], row[x]);
+    }
+}
+
+// Whether the middle of a few sample rows of rect sits elsewhere in the
+// same rows of the previous frame, checked before hashing every column
+template <class T>
+bool hasHorizontalMove(const QImage &current, const QImage &previous, const QRect &rect)
+{
+    enum { Window = 16 };
+    const int from = rect.x() + (rect.width() - Window) / 2;
+    for (int i = 1; i <= 3; ++i) {
+        const int y = rect.y() + rect.height() * i / 4;
+        const T *cur = reinterpret_cast<const T *>(current.constScanLine(y)) + from;
+        const T *prev = reinterpret_cast<const T *>(previous.constScanLine(y));
+        // Plain pixels would match anywhere, and unmoved ones tell nothing
+        if (std::all_of(cur + 1, cur + Window, [cur](T p) { return p == *cur; })
+            || memcmp(cur, prev + from, Window * sizeof(T)) == 0) {
+            continue;
+        }
+        for (int x = rect.x(); x + Window <= rect.x() + rect.width(); ++x) {
+            if (memcmp(prev + x, cur, Window * sizeof(T)) == 0)
+                return true;
+        }
+    }
+    return false;
+}
+
+template <class T>
+bool linesEqual(const QImage &a, int lineA, const QImage &b, int lineB,
+                const QRect &rect, bool vertical)
+{
+    if (vertical) {
+        return memcmp(a.constScanLine(lineA) + rect.x() * sizeof(T),
+                      b.constScanLine(lineB) + rect.x() * sizeof(T),
+                      rect.width() * sizeof(T)) == 0;
+    }
+    for (int y = rect.top(); y <= rect.bottom(); ++y) {
+        if (reinterpret_cast<const T *>(a.constScanLine(y))[lineA]
+            != reinterpret_cast<const T *>(b.constScanLine(y))[lineB]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Finds the shift of the previous frame's lines that most lines of rect
+// now show, and adds the runs of lines that moved by it to copied.
+template <class T>
+int findShift(const QImage &current, const QImage &previous, const QRect &rect,
+              bool vertical, QRegion *copied)
+{
+    QVector<quint64> cur;
+    QVector<quint64> prev;
+    hashLines<T>(current, rect, vertical, &cur);
+    hashLines<T>(previous, rect, vertical, &prev);
+    const int count = cur.size();
+    const int origin = vertical ? rect.y() : rect.x();
+
+    // Lines repeating their neighbour, like blank space, would match anywhere
+    QHash<quint64, int> prevLines;
+    for (int i = 0; i < count; ++i) {
+        if (i == 0 || prev[i] != prev[i - 1])
+            prevLines.insert(prev[i], i);
+    }
+
+    QHash<int, int> votes;
+    int shift = 0;
+    int bestVotes = 0;
+    for (int i = 0; i < count; ++i) {
+        if (cur[i] == prev[i] || (i > 0 && cur[i] == cur[i - 1]))
+            continue;
+        const auto it = prevLines.constFind(cur[i]);
+        if (it == prevLines.constEnd())
+            continue;
+        const int s = i - it.value();
+        const int v = ++votes[s];
+        if (v > bestVotes) {
+            bestVotes = v;
+            shift = s;
+        }
+    }
+    if (bestVotes < MinScrollVotes)
+        return 0;
+
+    const int first = qMax(0, shift);
+    const int last = qMin(count, count + shift);
+    int runStart = -1;
+    for (int i = first; i <= last; ++i) {
+        const bool match = i < last && cur[i] == prev[i - shift]
+                && linesEqual<T>(current, origin + i, previous, origin + i - shift, rect, vertical);
+        if (match) {
+            if (runStart < 0)
+                runStart = i;
+            continue;
+        }
+        if (runStart >= 0 && i - runStart >= MinScrollRun) {
+            *copied += vertical
+                    ? QRect(rect.x(), origin + runStart, rect.width(), i - runStart)
+                    : QRect(origin + runStart, rect.y(), i - runStart, rect.height());
+        }
+        runStart = -1;
+    }
+    return shift;
+}
+
+// The rows of dest whose pixels the previous frame had at dest - delta
+QRegion matchingRows(const QImage &image, const QImage &prevImage, const QRect &dest,
+                     const QPoint &delta)
+{
+    const int bytesPerPixel = image.depth() / 8;
+    const qsizetype length = qsizetype(dest.width()) * bytesPerPixel;
+    QRegion matched;
+    int runStart = -1;
+    for (int y = dest.top(); y <= dest.bottom() + 1; ++y) {
+        if (y <= dest.bottom()
+            && memcmp(image.constScanLine(y) + dest.x() * bytesPerPixel,
+                      prevImage.constScanLine(y - delta.y()) + (dest.x() - delta.x()) * bytesPerPixel,
+                      length) == 0) {
+            if (runStart < 0)
+                runStart = y;
+            continue;
+        }
+        if (runStart >= 0)
+            matched += QRect(dest.x(), runStart, dest.width(), y - runStart);
+        runStart = -1;
+    }
+    return matched;
+}
+
+qint64 regionArea(const QRegion &region)
+{
+    qint64 area = 0;
+    for (const QRect &rect : region)
+        area += qint64(rect.width()) * rect.height();
+    return area;
+}
+}
+
 QNoVncScreen::QNoVncScreen(const QStringList &args)
     : mArgs(args)
 {
@@ -88,6 +261,125 @@ bool QNoVncScreen::initialize()
     return true;
 }
 
+// Looks for content that moved, a dragged window or a scrolled list or log
+// view, and keeps the largest move in copiedRegion and copyDelta.
+void QNoVncScreen::detectMoves(const QRegion &changes)
+{
+    struct Move {
+        QPoint delta;
+        QRegion region;
+    };
+    QVector<Move> moves;
+    const QImage &prevImage = dirty->previousFrame();
+    auto addMove = [&moves](const QPoint &delta, const QRegion &region) {
+        auto it = std::find_if(moves.begin(), moves.end(),
+                               [&delta](const Move &move) { return move.delta == delta; });
+        if (it != moves.end())
+            it->region += region;
+        else
+            moves.append({ delta, region });
+    };
+
+    // A window that kept its size is copied from where the client still
+    // shows it, as far as the pixels agree; the exposed background and
+    // anything painted over it stay dirty
+    const QRect screenRect = mScreenImage.rect();
+    QHash<const QFbWindow *, QRect> windowGeometry;
+    QRegion above;
+    QRegion windowCopied;
+    for (const QFbWindow *window : std::as_const(mWindowStack)) {
+        if (!window->window()->isVisible())
+            continue;
+        const QRect geometry = window->geometry().translated(-mGeometry.topLeft());
+        windowGeometry.insert(window, geometry);
+
+        const QRect previous = m_windowGeometry.value(window);
+        if (previous.size() == geometry.size() && previous.topLeft() != geometry.topLeft()) {
+            const QPoint delta = geometry.topLeft() - previous.topLeft();
+            QRegion copied;
+            for (const QRect &rect : QRegion(geometry & screenRect & screenRect.translated(delta)) - above)
+                copied += matchingRows(mScreenImage, prevImage, rect, delta);
+            copied &= changes;
+            if (!copied.isEmpty()) {
+                addMove(delta, copied);
+                windowCopied += copied;
+            }
+        }
+        above += geometry;
+    }
+    m_windowGeometry = windowGeometry;
+
+    // Only what changed can have scrolled
+    for (const QRect &rect : changes - windowCopied) {
+        if (rect.width() < MinScrollSize || rect.height() < MinScrollSize)
+            continue;
+
+        // Horizontal scrolling is rare, so columns are only hashed when
+        // the rows did not move and sample rows suggest the columns did
+        for (const bool vertical : { true, false }) {
+            QRegion copied;
+            int shift = 0;
+            switch (mScreenImage.depth()) {
+            case 8:
+                if (vertical || hasHorizontalMove<quint8>(mScreenImage, prevImage, rect))
+                    shift = findShift<quint8>(mScreenImage, prevImage, rect, vertical, &copied);
+                break;
+            case 16:
+                if (vertical || hasHorizontalMove<quint16>(mScreenImage, prevImage, rect))
+                    shift = findShift<quint16>(mScreenImage, prevImage, rect, vertical, &copied);
+                break;
+            case 32:
+                if (vertical || hasHorizontalMove<quint32>(mScreenImage, prevImage, rect))
+                    shift = findShift<quint32>(mScreenImage, prevImage, rect, vertical, &copied);
+                break;
+            }
+            if (copied.isEmpty())
+                continue;
+
+            addMove(vertical ? QPoint(0, shift) : QPoint(shift, 0), copied);
+            break;
+        }
+    }
+
+    qint64 bestArea = 0;
+    for (const Move &move : std::as_const(moves)) {
+        const qint64 area = regionArea(move.region);
+        if (area > bestArea) {
+            bestArea = area;
+            copiedRegion = move.region;
+            copyDelta = move.delta;
+        }
+    }
+}
+
+void QNoVncScreen::clearDirty()
+{
+    dirtyRegion = QRegion();
+    copiedRegion = QRegion();
+    dirty->clear();
+}
+
+void QNoVncScreen::setImageFormat(QImage::Format format)
+{
+    if (mScreenImage.format() == format)
+        return;
+
+    mFormat = format;
+    mScreenImage = mScreenImage.convertToFormat(format);
+    dirty->setFormat(format);
+    for (QFbWindow *window : std::as_const(mWindowStack)) {
+        if (QFbBackingStore *backingStore = window->backingStore())
+            static_cast<QNoVncBackingStore *>(backingStore)->setFormat(format);
+    }
+}
+
+void QNoVncScreen::setFlushed(const QRegion &region)
+{
+    m_flushedRegion += region;
+    for (const QRect &rect : region)
+        setDirty(rect);
+}
+
 QRegion QNoVncScreen::doRedraw()
 {
     for (int i = 0; i < mWindowStack.size(); ++i)
@@ -123,29 +415,71 @@ QRegion QNoVncScreen::doRedraw()
     if (mRepaintRegion.isEmpty() && (!mCursor || !mCursor->isDirty()))
         return touchedRegion;
 
+    // Taken before the painter starts, so that a detach cannot leave the
+    // painter on other pixels than the row copies below
+    uchar *screenBits = mScreenImage.bits();
+    const qsizetype screenStride = mScreenImage.bytesPerLine();
+    const int bytesPerPixel = mScreenImage.depth() / 8;
     QPainter painter(&mScreenImage);
 
+    // Windows are drawn with CompositionMode_Source, so each replaces all
+    // below it: walking the stack from the top, only the part of a window
+    // that nothing above covers is drawn, and windows hidden below an
+    // opaque one are never touched.
+    struct Layer {
+        QRect rect;
+        QFbBackingStore *backingStore;
+    };
+    QVarLengthArray<Layer, 8> layers;
+    for (const QFbWindow *window : std::as_const(mWindowStack)) {
+        if (!window->window()->isVisible())
+            continue;
+        if (QFbBackingStore *backingStore = window->backingStore()) {
+            const QRect windowRect = window->geometry().translated(-screenOffset);
+            layers.append({ windowRect & QRect(windowRect.topLeft(), backingStore->image().size()),
+                            backingStore });
+        }
+    }
+
     const QRect screenRect = mGeometry.translated(-screenOffset);
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
     for (QRect rect : mRepaintRegion) {
         rect = rect.intersected(screenRect);
         if (rect.isEmpty())
             continue;
 
-        painter.setCompositionMode(QPainter::CompositionMode_Source);
-        painter.fillRect(rect, mScreenImage.hasAlphaChannel() ? Qt::transparent : Qt::black);
-
-        for (qsizetype layerIndex = mWindowStack.size() - 1; layerIndex != -1; layerIndex--) {
-            if (!mWindowStack[layerIndex]->window()->isVisible())
+        QRegion uncovered(rect);
+        for (const Layer &layer : std::as_const(layers)) {
+            const QRegion visible = uncovered & layer.rect;
+            if (visible.isEmpty())
                 continue;
-
-            const QRect windowRect = mWindowStack[layerIndex]->geometry().translated(-screenOffset);
-            const QRect windowIntersect = rect.translated(-windowRect.left(), -windowRect.top());
-            if (QFbBackingStore *backingStore = mWindowStack[layerIndex]->backingStore()) {
-                backingStore->lock();
-                painter.drawImage(rect, backingStore->image(), windowIntersect);
-                backingStore->unlock();
+            layer.backingStore->lock();
+            const QImage &image = layer.backingStore->image();
+            // Backing stores share the screen's format, which makes drawing a copy
+            const bool sameFormat = image.format() == mScreenImage.format()
+                    && image.devicePixelRatio() == 1;
+            for (const QRect &r : visible) {
+                const QPoint source = r.topLeft() - layer.rect.topLeft();
+                if (sameFormat) {
+                    const qsizetype length = qsizetype(r.width()) * bytesPerPixel;
+                    for (int y = 0; y < r.height(); ++y) {
+                        memcpy(screenBits + (r.y() + y) * screenStride + r.x() * bytesPerPixel,
+                               image.constScanLine(source.y() + y) + source.x() * bytesPerPixel,
+                               length);
+                    }
+                    ++copiedBlits;
+                } else {
+                    painter.drawImage(r, image, QRect(source, r.size()));
+                    ++convertedBlits;
+                }
             }
+            layer.backingStore->unlock();
+            uncovered -= layer.rect;
+            if (uncovered.isEmpty())
+                break;
         }
+        for (const QRect &r : uncovered)
+            painter.fillRect(r, mScreenImage.hasAlphaChannel() ? Qt::transparent : Qt::black);
     }
 
     if (mCursor && (mCursor->isDirty() || mRepaintRegion.intersects(mCursor->lastPainted()))) {
@@ -154,57 +488,16 @@ QRegion QNoVncScreen::doRedraw()
     }
     touchedRegion += mRepaintRegion;
 
-    QRegion realChanges;
-
-    if (m_prevScreenImage.size() != mScreenImage.size() ||
-        m_prevScreenImage.format() != mScreenImage.format())
-    {
-        m_prevScreenImage = mScreenImage.copy();
-        realChanges = touchedRegion;
-    }
-    else
-    {
-        const int depth = mScreenImage.depth() / 8;
-        const qsizetype bytesPerLine = mScreenImage.bytesPerLine();
-        const uchar *currBase = mScreenImage.bits();
-        const uchar *prevBase = m_prevScreenImage.bits();
-
-        const int TILE_SIZE = 64;
-
-        for (const QRect &largeRect : touchedRegion) {
-
-            // Subdivide the large rect into small tiles
-            for (int y = largeRect.y(); y <= largeRect.bottom(); y += TILE_SIZE) {
-                for (int x = largeRect.x(); x <= largeRect.right(); x += TILE_SIZE) {
-
-                    const int w = qMin(TILE_SIZE, largeRect.right() - x + 1);
-                    const int h = qMin(TILE_SIZE, largeRect.bottom() - y + 1);
-
-                    bool tileChanged = false;
-                    for (int row = 0; row < h; ++row) {
-                        const int lineOffset = ((y + row) * bytesPerLine) + (x * depth);
-                        // Compare one scanline of the tile
-                        if (memcmp(currBase + lineOffset, prevBase + lineOffset, w * depth) != 0) {
-                            tileChanged = true;
-                            break; // Stop checking this tile, it's dirty
-                        }
-                    }
-
-                    if (tileChanged) {
-                        realChanges += QRect(x, y, w, h);
-                    }
-                }
-            }
-        }
-
-        if (!touchedRegion.isEmpty()) {
-            QPainter shadowPainter(&m_prevScreenImage);
-            shadowPainter.setCompositionMode(QPainter::CompositionMode_Source);
-            for (const QRect &r : touchedRegion) {
-                shadowPainter.drawImage(r, mScreenImage, r);
-            }
-        }
-    }
+    // Moves are looked for against the previous frame, which a resize drops
+    const bool hasPreviousFrame = dirty->hasPreviousFrame();
+    static const bool trustDamage = qEnvironmentVariableIntValue("QNOVNC_TRUST_DAMAGE") == 1;
+    const QRegion trusted = trustDamage ? (m_flushedRegion.translated(-screenOffset) & touchedRegion)
+                                        : QRegion();
+    m_flushedRegion = QRegion();
+    const QRegion realChanges = dirty->compare(touchedRegion, trusted);
+    if (hasPreviousFrame)
+        detectMoves(realChanges);
+    dirty->commit();
 
     touchedRegion = realChanges;
 
@@ -212,7 +505,7 @@ QRegion QNoVncScreen::doRedraw()
 
     if (touchedRegion.isEmpty())
         return touchedRegion;
-    dirtyRegion += touchedRegion;
+    dirtyRegion += touchedRegion - copiedRegion;
 
     vncServer->setDirty();
     return touchedRegion;
@@ -5,6 +5,7 @@
 #define QNoVncScreen_H
 
 #include <QtFbSupport/private/qfbscreen_p.h>
+#include <QtCore/QHash>
 
 QT_BEGIN_NAMESPACE
 
@@ -35,7 +36,12 @@ public:
 
     Flags flags() const override;
 
-    void clearDirty() { dirtyRegion = QRegion(); }
+    void clearDirty();
+    // Switches the screen image, its previous frame and the windows'
+    // backing stores to another format, keeping their content
+    void setImageFormat(QImage::Format format);
+    // Marks what a window flushed for the next redraw, rect by rect
+    void setFlushed(const QRegion &region);
 
 #if Q_BYTE_ORDER == Q_BIG_ENDIAN
     bool swapBytes() const;
@@ -59,7 +65,14 @@ public:
     qreal dpiY = 96;
     QNoVncDirtyMap *dirty = nullptr;
     QRegion dirtyRegion;
+    // Changed area whose content moved by copyDelta since the previous frame
+    QRegion copiedRegion;
+    QPoint copyDelta;
     int refreshRate = 30;
+    // Window areas composed by row copies, and by converting painter draws
+    // because a backing store's format differs from the screen's
+    quint64 copiedBlits = 0;
+    quint64 convertedBlits = 0;
     bool m_readonly = false;
     QNoVncServer *vncServer = nullptr;
 #if QT_CONFIG(cursor)
@@ -67,7 +80,12 @@ public:
 #endif
 
 private:
-    QImage m_prevScreenImage; // Shadow buffer for previous frame
+    void detectMoves(const QRegion &changes);
+
+    QHash<const QFbWindow *, QRect> m_windowGeometry; // As of the previous frame
+    // Flushed by windows since the last redraw; with QNOVNC_TRUST_DAMAGE=1
+    // it counts as changed without being compared
+    QRegion m_flushedRegion;
 };
 
 QT_END_NAMESPACE
@@ -0,0 +1,417 @@
+// Copyright (C) 2026 CraftingDragon007
+// SPDX-License-Identifier: LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+#include "qnovncsimd.h"
+
+#include <QtCore/private/qsimd_p.h>
+
+#include <cstring>
+
+#if defined(Q_PROCESSOR_X86)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+QT_BEGIN_NAMESPACE
+
+namespace {
+
+typedef bool (*AnyRowChangedFunc)(const uchar *, const uchar *, qsizetype, qsizetype, int);
+
+bool anyRowChangedScalar(const uchar *a, const uchar *b, qsizetype stride,
+                         qsizetype rowBytes, int rows)
+{
+    for (int y = 0; y < rows; ++y, a += stride, b += stride) {
+        if (memcmp(a, b, rowBytes) != 0)
+            return true;
+    }
+    return false;
+}
+
+#if defined(__SSE2__)
+bool anyRowChangedSse2(const uchar *a, const uchar *b, qsizetype stride,
+                       qsizetype rowBytes, int rows)
+{
+    const qsizetype vectorBytes = rowBytes & ~qsizetype(15);
+    const __m128i zero = _mm_setzero_si128();
+    for (int y = 0; y < rows; ++y, a += stride, b += stride) {
+        // Differences are collected over the whole row and tested once
+        __m128i diff = zero;
+        for (qsizetype x = 0; x < vectorBytes; x += 16) {
+            const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + x));
+            const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + x));
+            diff = _mm_or_si128(diff, _mm_xor_si128(va, vb));
+        }
+        bool changed = _mm_movemask_epi8(_mm_cmpeq_epi8(diff, zero)) != 0xffff;
+        if (!changed && vectorBytes < rowBytes)
+            changed = memcmp(a + vectorBytes, b + vectorBytes, rowBytes - vectorBytes) != 0;
+        if (changed)
+            return true;
+    }
+    return false;
+}
+#endif
+
+#if defined(QT_COMPILER_SUPPORTS_AVX2)
+QT_FUNCTION_TARGET(AVX2)
+bool anyRowChangedAvx2(const uchar *a, const uchar *b, qsizetype stride,
+                       qsizetype rowBytes, int rows)
+{
+    const qsizetype vectorBytes = rowBytes & ~qsizetype(31);
+    for (int y = 0; y < rows; ++y, a += stride, b += stride) {
+        __m256i diff = _mm256_setzero_si256();
+        for (qsizetype x = 0; x < vectorBytes; x += 32) {
+            const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + x));
+            const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + x));
+            diff = _mm256_or_si256(diff, _mm256_xor_si256(va, vb));
+        }
+        bool changed = !_mm256_testz_si256(diff, diff);
+        if (!changed && vectorBytes < rowBytes)
+            changed = memcmp(a + vectorBytes, b + vectorBytes, rowBytes - vectorBytes) != 0;
+        if (changed)
+            return true;
+    }
+    return false;
+}
+#endif
+
+#if defined(__ARM_NEON)
+bool anyRowChangedNeon(const uchar *a, const uchar *b, qsizetype stride,
+                       qsizetype rowBytes, int rows)
+{
+    const qsizetype vectorBytes = rowBytes & ~qsizetype(15);
+    for (int y = 0; y < rows; ++y, a += stride, b += stride) {
+        uint8x16_t diff = vdupq_n_u8(0);
+        for (qsizetype x = 0; x < vectorBytes; x += 16)
+            diff = vorrq_u8(diff, veorq_u8(vld1q_u8(a + x), vld1q_u8(b + x)));
+        const uint64x2_t wide = vreinterpretq_u64_u8(diff);
+        bool changed = (vgetq_lane_u64(wide, 0) | vgetq_lane_u64(wide, 1)) != 0;
+        if (!changed && vectorBytes < rowBytes)
+            changed = memcmp(a + vectorBytes, b + vectorBytes, rowBytes - vectorBytes) != 0;
+        if (changed)
+            return true;
+    }
+    return false;
+}
+#endif
+
+typedef int (*ConvertPixelsFunc)(char *, const char *, int, int, const QNoVncSimd::PixelConversion &);
+
+int convertPixelsScalar(char *, const char *, int, int, const QNoVncSimd::PixelConversion &)
+{
+    return 0;
+}
+
+#if defined(__SSE2__)
+struct Sse2Conversion
+{
+    explicit Sse2Conversion(const QNoVncSimd::PixelConversion &c)
+    {
+        for (int i = 0; i < 3; ++i) {
+            inShift[i] = _mm_cvtsi32_si128(c.inShift[i]);
+            mask[i] = _mm_set1_epi32(int(c.mask[i]));
+            outShift[i] = _mm_cvtsi32_si128(c.outShift[i]);
+        }
+    }
+
+    __m128i apply(__m128i p) const
+    {
+        __m128i result = _mm_setzero_si128();
+        for (int i = 0; i < 3; ++i) {
+            const __m128i channel = _mm_and_si128(_mm_srl_epi32(p, inShift[i]), mask[i]);
+            result = _mm_or_si128(result, _mm_sll_epi32(channel, outShift[i]));
+        }
+        return result;
+    }
+
+    __m128i inShift[3];
+    __m128i mask[3];
+    __m128i outShift[3];
+};
+
+// RGB565 widened to 32 bits, to 0x00RRGGBB as the scalar code reads it
+inline __m128i expandRgb16Sse2(__m128i p)
+{
+    const __m128i r = _mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xf800)), 8);
+    const __m128i g = _mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0x07e0)), 5);
+    const __m128i b = _mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0x001f)), 3);
+    return _mm_or_si128(_mm_or_si128(r, g), b);
+}
+
+inline __m128i swap32Sse2(__m128i p)
+{
+    p = _mm_or_si128(_mm_slli_epi16(p, 8), _mm_srli_epi16(p, 8));
+    return _mm_or_si128(_mm_slli_epi32(p, 16), _mm_srli_epi32(p, 16));
+}
+
+int convertPixelsSse2(char *dst, const char *src, int count, int screenDepth,
+                      const QNoVncSimd::PixelConversion &conversion)
+{
+    const Sse2Conversion c(conversion);
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i a;
+        __m128i b;
+        if (screenDepth == 32) {
+            a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 4));
+            b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 4 + 16));
+        } else {
+            const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 2));
+            a = expandRgb16Sse2(_mm_unpacklo_epi16(p, zero));
+            b = expandRgb16Sse2(_mm_unpackhi_epi16(p, zero));
+        }
+        a = c.apply(a);
+        b = c.apply(b);
+
+        switch (conversion.bytesPerPixel) {
+        case 4:
+            if (conversion.swapBytes) {
+                a = swap32Sse2(a);
+                b = swap32Sse2(b);
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 4), a);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 4 + 16), b);
+            break;
+        case 2:
+            // The values fit 16 bits; swapping the bytes of each 16 bit half
+            // also swaps the ones the pack keeps
+            if (conversion.swapBytes) {
+                a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+                b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+            }
+            // Sign extension makes the signed saturating pack exact
+            a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+            b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 2), _mm_packs_epi32(a, b));
+            break;
+        default: {
+            const __m128i words = _mm_packs_epi32(a, b);
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(words, words));
+            break;
+        }
+        }
+    }
+    return i;
+}
+#endif
+
+#if defined(QT_COMPILER_SUPPORTS_AVX2)
+QT_FUNCTION_TARGET(AVX2)
+inline __m256i applyAvx2(__m256i p, const __m128i *inShift, const __m256i *mask,
+                         const __m128i *outShift)
+{
+    __m256i result = _mm256_setzero_si256();
+    for (int k = 0; k < 3; ++k) {
+        const __m256i channel = _mm256_and_si256(_mm256_srl_epi32(p, inShift[k]), mask[k]);
+        result = _mm256_or_si256(result, _mm256_sll_epi32(channel, outShift[k]));
+    }
+    return result;
+}
+
+QT_FUNCTION_TARGET(AVX2)
+inline __m256i expandRgb16Avx2(__m256i p)
+{
+    const __m256i r = _mm256_slli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0xf800)), 8);
+    const __m256i g = _mm256_slli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0x07e0)), 5);
+    const __m256i b = _mm256_slli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0x001f)), 3);
+    return _mm256_or_si256(_mm256_or_si256(r, g), b);
+}
+
+QT_FUNCTION_TARGET(AVX2)
+int convertPixelsAvx2(char *dst, const char *src, int count, int screenDepth,
+                      const QNoVncSimd::PixelConversion &conversion)
+{
+    __m128i inShift[3];
+    __m256i mask[3];
+    __m128i outShift[3];
+    for (int k = 0; k < 3; ++k) {
+        inShift[k] = _mm_cvtsi32_si128(conversion.inShift[k]);
+        mask[k] = _mm256_set1_epi32(int(conversion.mask[k]));
+        outShift[k] = _mm_cvtsi32_si128(conversion.outShift[k]);
+    }
+    const __m256i swap32 = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m256i swap16 = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                            1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i a;
+        __m256i b;
+        if (screenDepth == 32) {
+            a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i * 4));
+            b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i * 4 + 32));
+        } else {
+            const __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i * 2));
+            a = expandRgb16Avx2(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(p)));
+            b = expandRgb16Avx2(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(p, 1)));
+        }
+        a = applyAvx2(a, inShift, mask, outShift);
+        b = applyAvx2(b, inShift, mask, outShift);
+
+        switch (conversion.bytesPerPixel) {
+        case 4:
+            if (conversion.swapBytes) {
+                a = _mm256_shuffle_epi8(a, swap32);
+                b = _mm256_shuffle_epi8(b, swap32);
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 4), a);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 4 + 32), b);
+            break;
+        case 2: {
+            // The packs work per 128 bit lane, the permute restores the order
+            __m256i words = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xd8);
+            if (conversion.swapBytes)
+                words = _mm256_shuffle_epi8(words, swap16);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 2), words);
+            break;
+        }
+        default: {
+            const __m256i words = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xd8);
+            const __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0x88);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm256_castsi256_si128(bytes));
+            break;
+        }
+        }
+    }
+    return i;
+}
+#endif
+
+#if defined(__ARM_NEON)
+int convertPixelsNeon(char *dst, const char *src, int count, int screenDepth,
+                      const QNoVncSimd::PixelConversion &conversion)
+{
+    int32x4_t inShift[3];
+    uint32x4_t mask[3];
+    int32x4_t outShift[3];
+    for (int k = 0; k < 3; ++k) {
+        inShift[k] = vdupq_n_s32(-conversion.inShift[k]); // negative shifts go right
+        mask[k] = vdupq_n_u32(conversion.mask[k]);
+        outShift[k] = vdupq_n_s32(conversion.outShift[k]);
+    }
+    const auto apply = [&](uint32x4_t p) {
+        uint32x4_t result = vdupq_n_u32(0);
+        for (int k = 0; k < 3; ++k)
+            result = vorrq_u32(result, vshlq_u32(vandq_u32(vshlq_u32(p, inShift[k]), mask[k]), outShift[k]));
+        return result;
+    };
+    const auto expandRgb16 = [](uint32x4_t p) {
+        const uint32x4_t r = vshlq_n_u32(vandq_u32(p, vdupq_n_u32(0xf800)), 8);
+        const uint32x4_t g = vshlq_n_u32(vandq_u32(p, vdupq_n_u32(0x07e0)), 5);
+        const uint32x4_t b = vshlq_n_u32(vandq_u32(p, vdupq_n_u32(0x001f)), 3);
+        return vorrq_u32(vorrq_u32(r, g), b);
+    };
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint32x4_t a;
+        uint32x4_t b;
+        if (screenDepth == 32) {
+            a = vreinterpretq_u32_u8(vld1q_u8(reinterpret_cast<const uint8_t *>(src + i * 4)));
+            b = vreinterpretq_u32_u8(vld1q_u8(reinterpret_cast<const uint8_t *>(src + i * 4 + 16)));
+        } else {
+            const uint16x8_t p = vreinterpretq_u16_u8(vld1q_u8(reinterpret_cast<const uint8_t *>(src + i * 2)));
+            a = expandRgb16(vmovl_u16(vget_low_u16(p)));
+            b = expandRgb16(vmovl_u16(vget_high_u16(p)));
+        }
+        a = apply(a);
+        b = apply(b);
+
+        switch (conversion.bytesPerPixel) {
+        case 4: {
+            uint8x16_t bytesA = vreinterpretq_u8_u32(a);
+            uint8x16_t bytesB = vreinterpretq_u8_u32(b);
+            if (conversion.swapBytes) {
+                bytesA = vrev32q_u8(bytesA);
+                bytesB = vrev32q_u8(bytesB);
+            }
+            vst1q_u8(reinterpret_cast<uint8_t *>(dst + i * 4), bytesA);
+            vst1q_u8(reinterpret_cast<uint8_t *>(dst + i * 4 + 16), bytesB);
+            break;
+        }
+        case 2: {
+            uint8x16_t bytes = vreinterpretq_u8_u16(vcombine_u16(vmovn_u32(a), vmovn_u32(b)));
+            if (conversion.swapBytes)
+                bytes = vrev16q_u8(bytes);
+            vst1q_u8(reinterpret_cast<uint8_t *>(dst + i * 2), bytes);
+            break;
+        }
+        default:
+            vst1_u8(reinterpret_cast<uint8_t *>(dst + i),
+                    vmovn_u16(vcombine_u16(vmovn_u32(a), vmovn_u32(b))));
+            break;
+        }
+    }
+    return i;
+}
+#endif
+
+ConvertPixelsFunc resolveConvertPixels()
+{
+    if (qEnvironmentVariableIntValue("QNOVNC_NO_SIMD") == 1)
+        return convertPixelsScalar;
+#if defined(QT_COMPILER_SUPPORTS_AVX2)
+    if (qCpuHasFeature(AVX2))
+        return convertPixelsAvx2;
+#endif
+#if defined(__SSE2__)
+    return convertPixelsSse2;
+#elif defined(__ARM_NEON)
+    return convertPixelsNeon;
+#else
+    return convertPixelsScalar;
+#endif
+}
+
+AnyRowChangedFunc resolveAnyRowChanged()
+{
+    if (qEnvironmentVariableIntValue("QNOVNC_NO_SIMD") == 1)
+        return anyRowChangedScalar;
+#if defined(QT_COMPILER_SUPPORTS_AVX2)
+    if (qCpuHasFeature(AVX2))
+        return anyRowChangedAvx2;
+#endif
+#if defined(__SSE2__)
+    return anyRowChangedSse2;
+#elif defined(__ARM_NEON)
+    return anyRowChangedNeon;
+#else
+    return anyRowChangedScalar;
+#endif
+}
+
+} // namespace
+
+bool QNoVncSimd::anyRowChanged(const uchar *a, const uchar *b, qsizetype stride,
+                               qsizetype rowBytes, int rows)
+{
+    static const AnyRowChangedFunc func = resolveAnyRowChanged();
+    return func(a, b, stride, rowBytes, rows);
+}
+
+int QNoVncSimd::convertPixels(char *dst, const char *src, int count, int screenDepth,
+                              const PixelConversion &conversion)
+{
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    // The kernels read pixels like the scalar code only on little endian hosts
+    if ((screenDepth != 32 && screenDepth != 16)
+        || (conversion.bytesPerPixel != 1 && conversion.bytesPerPixel != 2
+            && conversion.bytesPerPixel != 4)) {
+        return 0;
+    }
+    static const ConvertPixelsFunc func = resolveConvertPixels();
+    return func(dst, src, count, screenDepth, conversion);
+#else
+    Q_UNUSED(dst);
+    Q_UNUSED(src);
+    Q_UNUSED(count);
+    Q_UNUSED(screenDepth);
+    Q_UNUSED(conversion);
+    return 0;
+#endif
+}
+
+QT_END_NAMESPACE
@@ -0,0 +1,47 @@
+// Copyright (C) 2026 CraftingDragon007
+// SPDX-License-Identifier: LGPL-3.0-only OR GPL-2.0-only OR GPL-3.0-only
+
+#ifndef QNOVNCSIMD_H
+#define QNOVNCSIMD_H
+
+#include <QtCore/qglobal.h>
+
+QT_BEGIN_NAMESPACE
+
+/**
+ * @brief Vectorized tile comparison and pixel conversion, picked for the
+ * CPU on first use
+ *
+ * AVX2 is chosen at runtime when the CPU has it, otherwise the baseline
+ * SSE2 or NEON version is used. QNOVNC_NO_SIMD=1 forces the plain C++
+ * versions.
+ */
+namespace QNoVncSimd {
+
+// Compares rows rows of rowBytes bytes, each stride apart in both buffers,
+// and returns true at the first row that differs
+bool anyRowChanged(const uchar *a, const uchar *b, qsizetype stride,
+                   qsizetype rowBytes, int rows);
+
+// How a screen pixel, read as 0x00RRGGBB, becomes a client pixel: channel
+// i is (p >> inShift[i] & mask[i]) << outShift[i], in red, green, blue order
+struct PixelConversion
+{
+    int inShift[3];
+    quint32 mask[3];
+    int outShift[3];
+    int bytesPerPixel;
+    bool swapBytes;
+};
+
+// Converts the leading pixels of a row of 32 or 16 bpp screen pixels and
+// returns how many were done, a multiple of the vector width; the rest is
+// left to the caller. Returns 0 for conversions without a kernel.
+int convertPixels(char *dst, const char *src, int count, int screenDepth,
+                  const PixelConversion &conversion);
+
+} // namespace QNoVncSimd
+
+QT_END_NAMESPACE
+
+#endif // QNOVNCSIMD_H
@@ -1,4 +1,5 @@
 #include "qnovncwindow.h"
+#include "qnovncscreen.h"
 
 QNoVncWindow::QNoVncWindow(QWindow *window)
     : QFbWindow(window)
@@ -9,4 +10,15 @@ QNoVncWindow::QNoVncWindow(QWindow *window)
 QImage* QNoVncWindow::image()
 {
     return &m_image;
+}
+
+void QNoVncWindow::flush(const QRegion &region)
+{
+    const QRect currentGeometry = geometry();
+    const QRect oldGeometry = mOldGeometry;
+    mOldGeometry = currentGeometry;
+    // A move also needs the previous location redrawn
+    if (oldGeometry != currentGeometry)
+        platformScreen()->setDirty(oldGeometry);
+    static_cast<QNoVncScreen *>(platformScreen())->setFlushed(region.translated(currentGeometry.topLeft()));
 }
\ No newline at end of file
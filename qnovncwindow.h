@@ -10,6 +10,10 @@ public:
 
     QImage* image();
 
+    // Like repaint(), but keeps the flushed region exact instead of
+    // reducing it to its bounding rect
+    void flush(const QRegion &region);
+
 private:
     QImage m_image;
 };
@@ -24,6 +24,7 @@ BuildRequires:  cmake
 BuildRequires:  gcc-c++
 BuildRequires:  make
 BuildRequires:  pkgconfig(zlib)
+BuildRequires:  pkgconfig(libjpeg)
 
 %if %{qt_major} == 6
 BuildRequires:  qt6-qtbase-devel